@@ -0,0 +1,367 @@
+/*
+ * cache.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Cache of parsed .hex files, keyed by their contents.
+ *
+ * an image file holds a header, then program memory, EEPROM and the
+ * coverage maps laid out as pic14_state_size lays them out in memory,
+ * so that a state can point right into a mapped image file.  the
+ * mapping is private, so the state may change its memories, and is
+ * held by the state's arena, which unmaps it when freed.  image
+ * files are named after the FNV-1a hash and size of the .hex text
+ * and the device ID, and use the host's byte order: a cache directory is
+ * meant for one machine.
+ */
+
+#if defined (__unix__) || defined (__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#define CACHE_MMAP
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CACHE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* CACHE_MMAP */
+
+#include "common.h"
+#include "hex.h"
+#include "cache.h"
+
+#define CACHE_VERSION 3
+
+/* FNV-1a, 32 bits */
+#define CACHE_FNV_BASIS 2166136261UL
+#define CACHE_FNV_PRIME 16777619UL
+
+/*
+ * an image file's header.
+ */
+typedef struct
+{
+  char magic[4];              /* "PK1C" */
+  unsigned int version;       /* CACHE_VERSION */
+  unsigned long hash;         /* of the .hex text */
+  unsigned long size;         /* .hex text length */
+  pic14_word device_id;
+
+  pic14_addr inst_len;
+  pic14_addr ee_len;
+  pic14_addr max_prog;
+  pic14_addr max_ee;
+  pic14_word configmask;      /* instchecksum holds config & mask */
+  pic14_word instchecksum;
+  byte eechecksum;
+
+  pic14_word id[PIC14_ID_LEN];
+  pic14_word config;
+  pic14_word osccal;
+  byte defined;
+
+  pic14_load_stats load;
+
+} cache_header;
+
+/* header size in the file: memory after it stays aligned */
+#define CACHE_HEAD_LEN ((sizeof (cache_header) + 7) & ~(size_t)7)
+
+/*
+ * hash the .hex text.
+ */
+static unsigned long
+cache_hash (const char *text, size_t len)
+{
+  unsigned long h = CACHE_FNV_BASIS;
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+    {
+      h ^= (byte)text[i];
+      h = (h * CACHE_FNV_PRIME) & 0xffffffffUL;
+    }
+
+  return h;
+}
+
+/*
+ * bytes of memory after the header, for these memory sizes.
+ */
+static size_t
+cache_block_len (pic14_addr inst_len, pic14_addr ee_len)
+{
+  return sizeof (pic14_word) * ((inst_len + 3) / 4 * 4 + ee_len)
+    + PIC14_MAP_LEN (inst_len) + PIC14_MAP_LEN (ee_len);
+}
+
+/*
+ * point the state's memories into an image's block.
+ */
+static void
+cache_point (pic14_program *g, byte *block)
+{
+  g->inst = (pic14_word *)block;
+  g->ee = g->inst + (g->inst_len + 3) / 4 * 4;
+  g->inst_map = (byte *)(g->ee + g->ee_len);
+  g->ee_map = g->inst_map + PIC14_MAP_LEN (g->inst_len);
+}
+
+#ifdef CACHE_MMAP
+/*
+ * unmap an image file, when its state's arena is freed.
+ */
+static void
+cache_unmap (void *addr, size_t len)
+{
+  munmap (addr, len);
+}
+#endif /* CACHE_MMAP */
+
+/*
+ * check that an image header is the one looked for.
+ */
+static int
+cache_match (const cache_header *h, unsigned long hash,
+	     size_t size, pic14_word device_id, const pic14_state *p)
+{
+  return !memcmp (h->magic, "PK1C", 4)
+    && h->version == CACHE_VERSION
+    && h->hash == hash
+    && h->size == size
+    && h->device_id == device_id
+    && h->inst_len == p->program.inst_len
+    && h->ee_len == p->program.ee_len
+    && h->configmask == p->config.configmask;
+}
+
+/*
+ * load the image at path into the state.  returns 0 if there is no
+ * such image, or not the right one.
+ */
+static int
+cache_load (pic14_state *p, const char *path, unsigned long hash,
+	    size_t size, pic14_word device_id)
+{
+  size_t len = CACHE_HEAD_LEN + cache_block_len (p->program.inst_len,
+						 p->program.ee_len);
+  const cache_header *h;
+  byte *base;
+  int i;
+
+#ifdef CACHE_MMAP
+  struct stat st;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (fstat (fd, &st) < 0 || (size_t)st.st_size != len)
+    {
+      close (fd);
+      return 0;
+    }
+
+  /* private mapping: the state may be changed, the file is not */
+  base = (byte *)mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		       fd, 0);
+  close (fd);
+
+  if (base == (byte *)MAP_FAILED)
+    return 0;
+
+  h = (const cache_header *)base;
+  if (!cache_match (h, hash, size, device_id, p)
+      || !pic14_arena_hold (p->arena, base, len, cache_unmap))
+    {
+      munmap (base, len);
+      return 0;
+    }
+#else
+  FILE *fp;
+
+  fp = fopen (path, "rb");
+  if (!fp)
+    return 0;
+
+  base = (byte *)pic14_arena_alloc (p->arena, len);
+  if (!base || fread (base, 1, len, fp) != len)
+    {
+      fclose (fp);
+      return 0;
+    }
+
+  fclose (fp);
+
+  h = (const cache_header *)base;
+  if (!cache_match (h, hash, size, device_id, p))
+    return 0;
+#endif /* CACHE_MMAP */
+
+  cache_point (&p->program, base + CACHE_HEAD_LEN);
+
+  p->program.max_prog = h->max_prog;
+  p->program.max_ee = h->max_ee;
+  p->program.instchecksum = h->instchecksum;
+  p->program.eechecksum = h->eechecksum;
+  p->program.summed = 1;
+
+  for (i = 0; i < PIC14_ID_LEN; ++i)
+    p->config.id[i] = h->id[i];
+
+  p->config.config = h->config;
+  p->config.osccal = h->osccal;
+  p->config.defined = h->defined;
+  p->load = h->load;
+
+  return 1;
+}
+
+/*
+ * store the state's image at path.  written to a temporary file
+ * first, so that a reader never sees half an image.
+ */
+static void
+cache_store (pic14_state *p, const char *path, unsigned long hash,
+	     size_t size, pic14_word device_id)
+{
+  pic14_program *g = &p->program;
+  union
+  {
+    cache_header h;
+    byte pad[CACHE_HEAD_LEN];
+  } head;
+  cache_header *h = &head.h;
+  char *tmp;
+  FILE *fp;
+  int i, ok;
+
+  memset (&head, 0, sizeof (head));
+  memcpy (h->magic, "PK1C", 4);
+  h->version = CACHE_VERSION;
+  h->hash = hash;
+  h->size = size;
+  h->device_id = device_id;
+
+  h->inst_len = g->inst_len;
+  h->ee_len = g->ee_len;
+  h->max_prog = g->max_prog;
+  h->max_ee = g->max_ee;
+  h->configmask = p->config.configmask;
+  h->instchecksum = g->instchecksum;
+  h->eechecksum = g->eechecksum;
+
+  for (i = 0; i < PIC14_ID_LEN; ++i)
+    h->id[i] = p->config.id[i];
+
+  h->config = p->config.config;
+  h->osccal = p->config.osccal;
+  h->defined = p->config.defined;
+  h->load = p->load;
+
+  tmp = (char *)malloc (strlen (path) + 5);
+  if (!tmp)
+    return;
+
+  sprintf (tmp, "%s.tmp", path);
+
+  fp = fopen (tmp, "wb");
+  if (!fp)
+    {
+      fprintf (stderr, "Warning: could not write cache file %s\n", tmp);
+      free (tmp);
+      return;
+    }
+
+  ok = fwrite (head.pad, CACHE_HEAD_LEN, 1, fp) == 1
+    && fwrite (g->inst, sizeof (pic14_word),
+	       (g->inst_len + 3) / 4 * 4, fp) == (g->inst_len + 3) / 4 * 4
+    && fwrite (g->ee, sizeof (pic14_word), g->ee_len, fp) == g->ee_len
+    && fwrite (g->inst_map, 1, PIC14_MAP_LEN (g->inst_len), fp)
+       == PIC14_MAP_LEN (g->inst_len)
+    && fwrite (g->ee_map, 1, PIC14_MAP_LEN (g->ee_len), fp)
+       == PIC14_MAP_LEN (g->ee_len);
+
+  if (fclose (fp) != 0)
+    ok = 0;
+
+  if (!ok || rename (tmp, path) != 0)
+    {
+      fprintf (stderr, "Warning: could not write cache file %s\n", path);
+      remove (tmp);
+    }
+
+  free (tmp);
+}
+
+/*
+ * read a .hex file through the cache.
+ */
+int
+cache_hex_read (pic14_state *p, FILE *src, const char *dir,
+		pic14_word device_id)
+{
+  unsigned long hash;
+  char *text, *path;
+  size_t len;
+  int ok;
+
+  text = hex_slurp (src, &len);
+  if (!text)
+    return 0;
+
+  hash = cache_hash (text, len);
+
+  path = (char *)malloc (strlen (dir) + 32);
+  if (!path)
+    {
+      ok = pic14_hex_read_buffer (p, text, len);
+      free (text);
+      if (ok)
+	pic14_calc_checksum (p);
+      return ok;
+    }
+
+  sprintf (path, "%s/%08lx%08lx-%04x.img", dir,
+	   hash, (unsigned long)len & 0xffffffffUL,
+	   device_id);
+
+  if (cache_load (p, path, hash, len, device_id))
+    {
+      /* tell what the .hex file held, as when reading it */
+      if (p->config.defined & PIC14_DEFINED_CONFIG)
+	printf (".hex file contains a configuration word\n");
+
+      pic14_print_load_stats (&p->load);
+      printf ("image taken from cache %s\n", path);
+
+      free (text);
+      free (path);
+      return 1;
+    }
+
+  ok = pic14_hex_read_buffer (p, text, len);
+  free (text);
+
+  /* the checksums are stored with the image, for writing and
+     --update to take */
+  if (ok)
+    {
+      pic14_calc_checksum (p);
+      cache_store (p, path, hash, len, device_id);
+    }
+
+  free (path);
+  return ok;
+}
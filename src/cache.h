@@ -0,0 +1,31 @@
+/*
+ * cache.h
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Cache of parsed .hex files, keyed by their contents.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include "pic14.h"
+
+/*
+ * read a .hex file into this state, which must be sized for the
+ * device device_id, with its configmask set.  the file's contents
+ * are hashed, and the parsed image is taken from the cache directory
+ * dir if it holds it, else the file is parsed and its image stored
+ * there.  either way the state's checksums are computed.  returns
+ * non-zero value on success.
+ */
+int cache_hex_read (pic14_state *p, FILE *src, const char *dir,
+		    pic14_word device_id);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,510 @@
+/*
+ * daemon.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Programmer daemon.  a client connects to the socket and sends a
+ * request header, with its standard output and error attached
+ * (SCM_RIGHTS), then its current directory and command line as NUL
+ * terminated strings.  the daemon runs the command there, writing
+ * to the client's descriptors, and answers with the exit status.
+ * one client is served at a time: there is one PICkit.
+ */
+
+#if defined (__unix__) || defined (__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#define DAEMON_SOCKETS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DAEMON_SOCKETS
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif /* DAEMON_SOCKETS */
+
+#include "daemon.h"
+
+#ifdef DAEMON_SOCKETS
+
+/* longest request: directory and command line */
+#define DAEMON_MAX_REQUEST 65536
+
+/* seconds a client has to send its request */
+#define DAEMON_TIMEOUT 10
+
+/*
+ * a request's header.
+ */
+typedef struct
+{
+  char magic[4];      /* "PK1D" */
+  unsigned int len;   /* bytes of strings which follow */
+  unsigned int argc;  /* strings of the command line */
+
+} daemon_header;
+
+/* set by SIGINT and SIGTERM */
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void
+daemon_signal (int sig)
+{
+  daemon_stop = sig;
+}
+
+/*
+ * read or write exactly len bytes.  returns 0 on errors or end of
+ * file.
+ */
+static int
+daemon_read (int fd, void *dest, size_t len)
+{
+  char *p = (char *)dest;
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = read (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+
+      p += n;
+      len -= n;
+    }
+
+  return 1;
+}
+
+static int
+daemon_write (int fd, const void *src, size_t len)
+{
+  const char *p = (const char *)src;
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = write (fd, p, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+
+      p += n;
+      len -= n;
+    }
+
+  return 1;
+}
+
+/*
+ * fill in the socket address for path.  returns 0 if it is too long.
+ */
+static int
+daemon_address (struct sockaddr_un *sa, const char *path)
+{
+  memset (sa, 0, sizeof (*sa));
+  sa->sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (sa->sun_path))
+    {
+      fprintf (stderr, "Error: socket path too long: %s\n", path);
+      return 0;
+    }
+
+  strcpy (sa->sun_path, path);
+  return 1;
+}
+
+/*
+ * receive a request's header and the descriptors attached to it.
+ * returns -1 if the client left without a word (such as a daemon
+ * checking whether the socket is in use), 0 on bad requests.
+ */
+static int
+daemon_receive (int c, daemon_header *h, int fds[2])
+{
+  union
+  {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE (2 * sizeof (int))];
+  } ctl;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+
+  iov.iov_base = h;
+  iov.iov_len = sizeof (*h);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+
+  do
+    n = recvmsg (c, &msg, 0);
+  while (n < 0 && errno == EINTR);
+
+  if (n == 0)
+    return -1;
+
+  if (n != sizeof (*h))
+    return 0;
+
+  cm = CMSG_FIRSTHDR (&msg);
+  if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+      || cm->cmsg_len != CMSG_LEN (2 * sizeof (int)))
+    return 0;
+
+  memcpy (fds, CMSG_DATA (cm), 2 * sizeof (int));
+
+  /* each string of the command line takes a byte at least */
+  return !memcmp (h->magic, "PK1D", 4) && h->len <= DAEMON_MAX_REQUEST
+    && h->argc <= h->len;
+}
+
+/*
+ * run one client's request.
+ */
+static void
+daemon_request (int c, daemon_handler fn, void *data)
+{
+  int fds[2] = { -1, -1 }, saved[2];
+  const char **argv = NULL;
+  char *text = NULL, *p, cwd[4096];
+  daemon_header h;
+  unsigned int i;
+  int rc;
+
+  rc = daemon_receive (c, &h, fds);
+  if (rc <= 0)
+    {
+      if (rc == 0)
+	fprintf (stderr, "Warning: bad request, ignored\n");
+      goto done;
+    }
+
+  text = (char *)malloc (h.len + 1);
+  argv = (const char **)malloc ((h.argc + 1) * sizeof (char *));
+  if (!text || !argv || !daemon_read (c, text, h.len))
+    goto done;
+
+  /* the directory, then the command line */
+  text[h.len] = '\0';
+  p = text + strlen (text) + 1;
+
+  for (i = 0; i < h.argc; ++i)
+    {
+      if (p >= text + h.len)
+	goto done;
+
+      argv[i] = p;
+      p += strlen (p) + 1;
+    }
+
+  argv[i] = NULL;
+
+  if (!getcwd (cwd, sizeof (cwd)))
+    goto done;
+
+  /* the command writes to the client */
+  fflush (stdout);
+  fflush (stderr);
+
+  saved[0] = dup (STDOUT_FILENO);
+  saved[1] = dup (STDERR_FILENO);
+  dup2 (fds[0], STDOUT_FILENO);
+  dup2 (fds[1], STDERR_FILENO);
+
+  if (chdir (text) == 0)
+    rc = fn ((int)h.argc, argv, data);
+  else
+    {
+      fprintf (stderr, "Error: daemon could not enter %s\n", text);
+      rc = EXIT_FAILURE;
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+
+  dup2 (saved[0], STDOUT_FILENO);
+  dup2 (saved[1], STDERR_FILENO);
+  close (saved[0]);
+  close (saved[1]);
+
+  if (chdir (cwd) != 0)
+    perror ("Could not go back to the daemon's directory");
+
+  printf ("request:");
+  for (i = 1; i < h.argc; ++i)
+    printf (" %s", argv[i]);
+  printf (" -> %d\n", rc);
+  fflush (stdout);
+
+  daemon_write (c, &rc, sizeof (rc));
+
+ done:
+  if (fds[0] >= 0)
+    {
+      close (fds[0]);
+      close (fds[1]);
+    }
+
+  free (argv);
+  free (text);
+}
+
+/*
+ * listen on the socket.
+ */
+int
+daemon_listen (const char *path)
+{
+  struct sockaddr_un sa;
+  mode_t mask;
+  int fd;
+
+  if (!daemon_address (&sa, path))
+    return -1;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror ("Could not create the socket");
+      return -1;
+    }
+
+  /* a socket left by a daemon which is gone is replaced */
+  if (connect (fd, (struct sockaddr *)&sa, sizeof (sa)) == 0)
+    {
+      fprintf (stderr, "Error: a daemon already listens on %s\n", path);
+      close (fd);
+      return -1;
+    }
+
+  close (fd);
+  unlink (path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror ("Could not create the socket");
+      return -1;
+    }
+
+  /* only our user may send commands */
+  mask = umask (077);
+  if (bind (fd, (struct sockaddr *)&sa, sizeof (sa)) < 0
+      || listen (fd, 8) < 0)
+    {
+      umask (mask);
+      perror ("Could not listen on the socket");
+      close (fd);
+      return -1;
+    }
+
+  umask (mask);
+
+  return fd;
+}
+
+/*
+ * stop listening.
+ */
+void
+daemon_close (int fd, const char *path)
+{
+  close (fd);
+  unlink (path);
+}
+
+/*
+ * serve clients.
+ */
+int
+daemon_serve (int fd, const char *path, daemon_handler fn, void *data)
+{
+  struct sigaction act;
+  struct timeval tv;
+  int c;
+
+  /* no SA_RESTART: a signal ends accept */
+  memset (&act, 0, sizeof (act));
+  act.sa_handler = daemon_signal;
+  sigemptyset (&act.sa_mask);
+  sigaction (SIGINT, &act, NULL);
+  sigaction (SIGTERM, &act, NULL);
+
+  /* a client gone ends its writes, not the daemon */
+  act.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &act, NULL);
+
+  printf ("daemon listening on %s\n", path);
+  fflush (stdout);
+
+  while (!daemon_stop)
+    {
+      c = accept (fd, NULL, NULL);
+      if (c < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  perror ("Could not accept a client");
+	  break;
+	}
+
+      /* a client which sends nothing does not hold the daemon */
+      tv.tv_sec = DAEMON_TIMEOUT;
+      tv.tv_usec = 0;
+      setsockopt (c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+      daemon_request (c, fn, data);
+      close (c);
+    }
+
+  daemon_close (fd, path);
+
+  if (daemon_stop)
+    printf ("daemon stopped\n");
+
+  return daemon_stop != 0;
+}
+
+/*
+ * send a request and wait for its exit status.
+ */
+int
+daemon_call (const char *path, int argc, const char *argv[], int *result)
+{
+  union
+  {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE (2 * sizeof (int))];
+  } ctl;
+  int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+  struct sockaddr_un sa;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  struct iovec iov;
+  daemon_header h;
+  char cwd[4096];
+  size_t len;
+  int fd, i, ok;
+
+  if (!daemon_address (&sa, path))
+    return 0;
+
+  if (!getcwd (cwd, sizeof (cwd)))
+    {
+      perror ("Could not get the current directory");
+      return 0;
+    }
+
+  len = strlen (cwd) + 1;
+  for (i = 0; i < argc; ++i)
+    len += strlen (argv[i]) + 1;
+
+  if (len > DAEMON_MAX_REQUEST)
+    {
+      fprintf (stderr, "Error: command line too long\n");
+      return 0;
+    }
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *)&sa, sizeof (sa)) < 0)
+    {
+      fprintf (stderr, "Error: no daemon listening on %s: %s\n", path,
+	       strerror (errno));
+      if (fd >= 0)
+	close (fd);
+      return 0;
+    }
+
+  memcpy (h.magic, "PK1D", 4);
+  h.len = len;
+  h.argc = argc;
+
+  iov.iov_base = &h;
+  iov.iov_len = sizeof (h);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+
+  cm = CMSG_FIRSTHDR (&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN (2 * sizeof (int));
+  memcpy (CMSG_DATA (cm), fds, 2 * sizeof (int));
+
+  fflush (stdout);
+  fflush (stderr);
+
+  ok = sendmsg (fd, &msg, 0) == sizeof (h)
+    && daemon_write (fd, cwd, strlen (cwd) + 1);
+
+  for (i = 0; ok && i < argc; ++i)
+    ok = daemon_write (fd, argv[i], strlen (argv[i]) + 1);
+
+  if (ok && !daemon_read (fd, result, sizeof (*result)))
+    {
+      fprintf (stderr, "Error: the daemon stopped before answering\n");
+      ok = 0;
+    }
+  else if (!ok)
+    fprintf (stderr, "Error: could not send the command to the daemon\n");
+
+  close (fd);
+
+  return ok;
+}
+
+#else
+
+int
+daemon_listen (const char *path)
+{
+  fprintf (stderr, "Error: no daemon on this system\n");
+  return -1;
+}
+
+void
+daemon_close (int fd, const char *path)
+{
+}
+
+int
+daemon_serve (int fd, const char *path, daemon_handler fn, void *data)
+{
+  fprintf (stderr, "Error: no daemon on this system\n");
+  return 0;
+}
+
+int
+daemon_call (const char *path, int argc, const char *argv[], int *result)
+{
+  fprintf (stderr, "Error: no daemon on this system\n");
+  return 0;
+}
+
+#endif /* DAEMON_SOCKETS */
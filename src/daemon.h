@@ -0,0 +1,52 @@
+/*
+ * daemon.h
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Programmer daemon: commands run by a long-running process holding
+ * the PICkit, sent to it over a UNIX domain socket.
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+/* socket used when PICKIT_SOCKET is not set */
+#define DAEMON_SOCKET "/tmp/pickit1.socket"
+
+/* runs a command line sent by a client, with the standard output
+   and error of the client.  returns the client's exit status */
+typedef int (*daemon_handler) (int argc, const char *argv[], void *data);
+
+/*
+ * create the socket path and listen on it.  returns the socket, or
+ * -1 on errors, such as another daemon listening there.
+ */
+int daemon_listen (const char *path);
+
+/* close the socket fd and remove it from path */
+void daemon_close (int fd, const char *path);
+
+/*
+ * run the command lines of clients of the socket fd (created by
+ * daemon_listen at path) one after another with fn, until SIGINT or
+ * SIGTERM.  the socket is closed and removed.  returns non-zero value
+ * if it stopped on a signal.
+ */
+int daemon_serve (int fd, const char *path, daemon_handler fn,
+		  void *data);
+
+/*
+ * have the daemon listening on the socket path run this command line
+ * in the current directory, with our standard output and error.  the
+ * command's exit status is stored in result.  returns 0 if the daemon
+ * could not be reached, or did not answer.
+ */
+int daemon_call (const char *path, int argc, const char *argv[],
+		 int *result);
+
+#endif /* __DAEMON_H__ */
@@ -0,0 +1,935 @@
+/*
+ * gang.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Gang programming.  the PICkits are opened one after another, then
+ * each one is driven by its own thread.  the threads share the
+ * parsed .hex file: each works on a copy of its pic14_state, which
+ * points to the same (read only) memories.
+ *
+ * a job file is run the same way.  its jobs are dealt out to the
+ * PICkits holding a chip of the right type, each PICkit getting a
+ * queue of its own.  a PICkit done with its queue steals jobs from
+ * the queue of another PICkit with the same type of chip, so that
+ * none sits idle while jobs are left.  each job after a PICkit's first
+ * waits for its chip to be changed.
+ *
+ * a USB transfer error fails only the PICkit it happened on, and ends
+ * its thread; the others carry on.  the threads print no progress,
+ * only their results.
+ */
+
+#if defined (__unix__) || defined (__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "usb_pickit.h"
+#include "cache.h"
+#include "gang.h"
+
+typedef struct gang_sched gang_sched;
+
+/*
+ * a line of a job file: count chips of one type, programmed with
+ * one .hex file.
+ */
+typedef struct
+{
+  int line;
+  char *filename;
+  int count;
+  pic14_device file; /* the .hex file, parsed for the chip type */
+  bool parsed;
+
+} gang_batch;
+
+/*
+ * one chip to program.
+ */
+typedef struct
+{
+  gang_batch *batch;
+  int chip; /* number of the chip in its batch */
+
+  int unit; /* PICkit which did it, -1 if none */
+  bool ok;
+  char result[64];
+  unsigned long usec;
+
+} gang_job;
+
+/*
+ * a PICkit of the gang, with the chip in its socket.
+ */
+typedef struct
+{
+  int unit;
+  usb_pickit *d;
+
+  pic14_device dev; /* chip found in the socket */
+  pic14_arena arena; /* dev's memories */
+  bool found;
+
+  pic14_state image; /* the .hex file */
+  unsigned int what;
+  int max_errors;
+
+  pthread_t thread;
+  bool started;
+
+  bool ok;
+  char result[64];
+  unsigned long usec;
+
+  /* job queue: the owner takes jobs from the head, thieves from the
+     tail, so that they only meet on the last job */
+  gang_sched *sched;
+  pthread_mutex_t lock;
+  gang_job **queue;
+  int head, tail;
+  int jobs, stolen;
+
+} gang_socket;
+
+/*
+ * jobs shared by the PICkits.
+ */
+struct gang_sched
+{
+  gang_socket *sockets;
+  int n;
+  int max_errors;
+  int poll; /* ms between looks for a new chip */
+  int timeout; /* s to wait for it */
+
+  pthread_mutex_t print; /* one line of output at a time */
+};
+
+/*
+ * do the gang's work on one PICkit.
+ */
+static void
+gang_work (gang_socket *g)
+{
+  unsigned long t0 = pickit_clock ();
+  const char *done = "";
+  pickit_stats st;
+
+  g->ok = 1;
+
+  if ((g->what & GANG_UPDATE) && usb_pickit_is_programmed (g->d, &g->image))
+    done = "already programmed";
+  else if (g->what & (GANG_PROGRAM | GANG_UPDATE))
+    {
+      usb_pickit_write (g->d, &g->image, 1);
+      done = "programmed";
+    }
+
+  if (g->what & GANG_VERIFY)
+    {
+      g->ok = usb_pickit_verify_device (g->d, &g->image, NULL, NULL, 0,
+					g->max_errors);
+
+      sprintf (g->result, "%s%s%s", done, *done ? ", " : "",
+	       g->ok ? "verified" : "FAILED to verify");
+    }
+  else
+    strcpy (g->result, done);
+
+  /* the time the transport knows (emulated), else the time taken */
+  usb_pickit_stats (g->d, &st);
+  g->usec = st.usec ? st.usec : pickit_clock () - t0;
+}
+
+/*
+ * thread of one PICkit.  a transfer error fails it, not the gang.
+ */
+static void *
+gang_worker (void *arg)
+{
+  gang_socket *g = (gang_socket *)arg;
+  unsigned long t0 = pickit_clock ();
+  jmp_buf env;
+
+  if (setjmp (env))
+    {
+      usb_pickit_catch (g->d, NULL);
+      g->ok = 0;
+      g->usec = pickit_clock () - t0;
+      strcpy (g->result, "USB transfer failed");
+      return NULL;
+    }
+
+  usb_pickit_catch (g->d, &env);
+  gang_work (g);
+  usb_pickit_catch (g->d, NULL);
+
+  return NULL;
+}
+
+/*
+ * read the .hex file for this type of device.
+ */
+static int
+gang_hex_read (pic14_device *file, const char *filename,
+	       const char *cache_dir)
+{
+  FILE *fp;
+  int ok;
+
+  fp = fopen (filename, "r");
+  if (!fp)
+    {
+      perror ("Could not open program file");
+      return 0;
+    }
+
+  if (cache_dir)
+    ok = cache_hex_read (&file->state, fp, cache_dir,
+			 file->dinfo->device_id);
+  else
+    ok = pic14_hex_read (&file->state, fp);
+
+  fclose (fp);
+
+  return ok;
+}
+
+/*
+ * parse the .hex file filename into file, for chips of type dinfo.
+ */
+static int
+gang_image (pic14_device *file, const pic14_device_info *dinfo,
+	    const char *filename, const char *cache_dir, pic14_arena *arena)
+{
+  file->dinfo = dinfo;
+  pic14_state_init (&file->state);
+  file->state.arena = arena;
+
+  /* before reading: the cache stores the checksum with the mask */
+  file->state.config.save_osccal = dinfo->save_osccal;
+  file->state.config.configmask = dinfo->configmask;
+
+  if (!pic14_state_size (&file->state, dinfo->inst_len, dinfo->ee_len)
+      || !gang_hex_read (file, filename, cache_dir))
+    return 0;
+
+  if (!file->state.program.summed)
+    pic14_calc_checksum (&file->state);
+
+  return 1;
+}
+
+/*
+ * open the n PICkits and find their chips, one after another.
+ * returns NULL if out of memory.
+ */
+static gang_socket *
+gang_open (int n)
+{
+  gang_socket *sockets;
+  int i;
+
+  sockets = (gang_socket *)calloc (n, sizeof (gang_socket));
+  if (!sockets)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      return NULL;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+
+      g->unit = i;
+      strcpy (g->result, "could not be opened");
+
+      g->d = usb_pickit_open_unit (i);
+      if (!g->d)
+	continue;
+
+      pic14_arena_init (&g->arena);
+      pic14_state_init (&g->dev.state);
+      g->dev.state.arena = &g->arena;
+
+      if (!usb_pickit_get_device (g->d, &g->dev))
+	{
+	  strcpy (g->result, "no PIC or unsupported PIC");
+	  continue;
+	}
+
+      g->found = 1;
+      strcpy (g->result, "not started");
+    }
+
+  return sockets;
+}
+
+/*
+ * close the PICkits opened by gang_open.
+ */
+static void
+gang_close (gang_socket *sockets, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+    if (sockets[i].d)
+      {
+	usb_pickit_close (sockets[i].d);
+	pic14_arena_free (&sockets[i].arena);
+      }
+
+  free (sockets);
+}
+
+/*
+ * print each PICkit's result.
+ */
+static void
+gang_report (gang_socket *sockets, int n)
+{
+  int i, ok = 0;
+
+  printf ("\nPICkit  device        result\n");
+
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+      char device[16] = "-";
+
+      if (g->found)
+	sprintf (device, "%s rev %d", g->dev.dinfo->device_name,
+		 g->dev.rev);
+
+      if (g->started)
+	printf ("%6d  %-12s  %s (%lu.%03lu s)\n", g->unit, device, g->result,
+		g->usec / 1000000, g->usec / 1000 % 1000);
+      else
+	printf ("%6d  %-12s  %s\n", g->unit, device, g->result);
+
+      if (g->ok)
+	ok++;
+    }
+
+  printf ("%d of %d PICkits succeeded\n", ok, n);
+}
+
+/*
+ * run the gang.
+ */
+int
+gang_run (const char *filename, const char *cache_dir, unsigned int what,
+	  int max_errors)
+{
+  gang_socket *sockets, *first = NULL;
+  pic14_device file;
+  pic14_arena arena;
+  int i, n, ok = 1;
+
+  n = usb_pickit_count ();
+  if (n <= 0)
+    {
+      fprintf (stderr, "Could not find any PICKit\n");
+      return 0;
+    }
+
+  printf ("gang of %d PICkits\n", n);
+
+  sockets = gang_open (n);
+  if (!sockets)
+    return 0;
+
+  for (i = 0; !first && i < n; ++i)
+    if (sockets[i].found)
+      first = &sockets[i];
+
+  /* parse the .hex file once, for the type of the first chip */
+  pic14_arena_init (&arena);
+
+  if (first && !gang_image (&file, first->dev.dinfo, filename, cache_dir,
+			    &arena))
+    first = NULL;
+
+  /* one thread per PICkit holding a chip of that type */
+  for (i = 0; first && i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+
+      if (!g->found)
+	continue;
+
+      if (g->dev.dinfo != file.dinfo)
+	{
+	  sprintf (g->result, "not a PIC%s", file.dinfo->device_name);
+	  continue;
+	}
+
+      g->image = file.state;
+      g->what = what;
+      g->max_errors = max_errors;
+      usb_pickit_quiet (g->d, 1);
+
+      if (pthread_create (&g->thread, NULL, gang_worker, g) != 0)
+	{
+	  strcpy (g->result, "could not start a thread");
+	  continue;
+	}
+
+      g->started = 1;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+
+      if (g->started)
+	pthread_join (g->thread, NULL);
+      else
+	g->ok = 0;
+
+      if (!g->ok)
+	ok = 0;
+    }
+
+  gang_report (sockets, n);
+  gang_close (sockets, n);
+
+  pic14_arena_free (&arena);
+
+  return ok;
+}
+
+/*
+ * find a device by name, with or without the "PIC" in front.
+ */
+static const pic14_device_info *
+gang_device (const char *name)
+{
+  const pic14_device_info *d;
+
+  if (!strncmp (name, "PIC", 3))
+    name += 3;
+
+  for (d = __devices; d->device_id != 0xffff; ++d)
+    if (!strcmp (d->device_name, name))
+      return d;
+
+  return NULL;
+}
+
+/*
+ * read a job file: lines of "<device> <file> [<count>]", blank lines
+ * and "#" comments left apart.  returns the number of batches, 0 if
+ * there are none, -1 on errors.
+ */
+static int
+gang_read_jobs (const char *jobfile, gang_batch **batches)
+{
+  char line[1024], name[32], *filename;
+  gang_batch *b = NULL, *more;
+  int n = 0, lineno = 0, count, len;
+  FILE *fp;
+
+  fp = fopen (jobfile, "r");
+  if (!fp)
+    {
+      perror ("Could not open job file");
+      return -1;
+    }
+
+  while (fgets (line, sizeof (line), fp))
+    {
+      const pic14_device_info *dinfo;
+      char file[sizeof (line)];
+      int fields;
+
+      lineno++;
+      line[strcspn (line, "#\n")] = '\0';
+
+      count = 1;
+      fields = sscanf (line, "%31s %1023s %d", name, file, &count);
+      if (fields <= 0)
+	continue;
+
+      if (fields < 2 || count < 1)
+	{
+	  fprintf (stderr, "Error: %s:%d: expected "
+		   "<device> <file> [<count>]\n", jobfile, lineno);
+	  goto fail;
+	}
+
+      dinfo = gang_device (name);
+      if (!dinfo)
+	{
+	  fprintf (stderr, "Error: %s:%d: unknown device '%s'\n",
+		   jobfile, lineno, name);
+	  goto fail;
+	}
+
+      len = strlen (file);
+      more = (gang_batch *)realloc (b, (n + 1) * sizeof (gang_batch));
+      filename = (char *)malloc (len + 1);
+      if (!more || !filename)
+	{
+	  fprintf (stderr, "Error: out of memory\n");
+	  free (filename);
+	  if (more)
+	    b = more;
+	  goto fail;
+	}
+
+      b = more;
+      memset (&b[n], 0, sizeof (gang_batch));
+      b[n].line = lineno;
+      b[n].filename = strcpy (filename, file);
+      b[n].count = count;
+      b[n].file.dinfo = dinfo;
+      n++;
+    }
+
+  fclose (fp);
+
+  *batches = b;
+  return n;
+
+ fail:
+  fclose (fp);
+
+  while (n-- > 0)
+    free (b[n].filename);
+  free (b);
+
+  return -1;
+}
+
+/*
+ * take the next job for this PICkit: from its own queue, else
+ * stolen from another PICkit holding the same type of chip.
+ */
+static gang_job *
+gang_take (gang_socket *g)
+{
+  gang_sched *s = g->sched;
+  gang_job *job = NULL;
+  int i;
+
+  pthread_mutex_lock (&g->lock);
+  if (g->head < g->tail)
+    job = g->queue[g->head++];
+  pthread_mutex_unlock (&g->lock);
+
+  for (i = 1; !job && i < s->n; ++i)
+    {
+      gang_socket *v = &s->sockets[(g->unit + i) % s->n];
+
+      if (!v->queue || v->dev.dinfo != g->dev.dinfo)
+	continue;
+
+      pthread_mutex_lock (&v->lock);
+      if (v->head < v->tail)
+	job = v->queue[--v->tail];
+      pthread_mutex_unlock (&v->lock);
+
+      if (job)
+	g->stolen++;
+    }
+
+  return job;
+}
+
+/*
+ * print how a job went.
+ */
+static void
+gang_job_print (gang_socket *g, gang_job *job)
+{
+  gang_sched *s = g->sched;
+
+  pthread_mutex_lock (&s->print);
+  printf ("PICkit %d: %s chip %d of %d %s (%lu.%03lu s)\n", g->unit,
+	  job->batch->filename, job->chip + 1, job->batch->count,
+	  job->result, job->usec / 1000000, job->usec / 1000 % 1000);
+  fflush (stdout);
+  pthread_mutex_unlock (&s->print);
+}
+
+/*
+ * ask for the job's chip and wait until the chip in the socket is
+ * taken out and another one put in.  returns 0 if none came in time.
+ */
+static int
+gang_swap (gang_socket *g, gang_job *job)
+{
+  gang_sched *s = g->sched;
+  usb_pickit_socket w = { 0, 0, 1 };
+  unsigned long waited;
+
+  pthread_mutex_lock (&s->print);
+  printf ("PICkit %d: put in %s chip %d of %d\n", g->unit,
+	  job->batch->filename, job->chip + 1, job->batch->count);
+  fflush (stdout);
+  pthread_mutex_unlock (&s->print);
+
+  for (waited = 0; waited < s->timeout * 1000UL; waited += s->poll)
+    {
+      if (usb_pickit_watch (g->d, &w) == PICKIT_CHIP_IN)
+	{
+	  if (pic14_get_device (w.id & 0xffe0) == g->dev.dinfo)
+	    return 1;
+
+	  /* the PICkit is kept for its chip type: wait for another */
+	  pthread_mutex_lock (&s->print);
+	  printf ("PICkit %d: not a PIC%s, put in another chip\n",
+		  g->unit, g->dev.dinfo->device_name);
+	  fflush (stdout);
+	  pthread_mutex_unlock (&s->print);
+	}
+
+      pickit_sleep ((unsigned long)s->poll * 1000);
+    }
+
+  return 0;
+}
+
+/*
+ * program and verify the chip of one job, once it is put in the
+ * socket if swap is set.  returns 0 if the PICkit must stop: no chip
+ * came, or a transfer failed.
+ */
+static int
+gang_job_run (gang_socket *g, gang_job *job, bool swap)
+{
+  gang_sched *s = g->sched;
+  pic14_state image;
+  unsigned long t0, before;
+  pickit_stats st;
+  jmp_buf env;
+
+  job->unit = g->unit;
+
+  if (setjmp (env))
+    {
+      usb_pickit_catch (g->d, NULL);
+      job->ok = 0;
+      strcpy (job->result, "USB transfer failed");
+      gang_job_print (g, job);
+      return 0;
+    }
+
+  usb_pickit_catch (g->d, &env);
+
+  if (swap && !gang_swap (g, job))
+    {
+      usb_pickit_catch (g->d, NULL);
+      strcpy (job->result, "no chip put in");
+      gang_job_print (g, job);
+      return 0;
+    }
+
+  /* a copy: writing changes the state's configuration */
+  image = job->batch->file.state;
+  t0 = pickit_clock ();
+
+  usb_pickit_stats (g->d, &st);
+  before = st.usec;
+
+  usb_pickit_write (g->d, &image, 1);
+  job->ok = usb_pickit_verify_device (g->d, &image, NULL, NULL, 0,
+				      s->max_errors);
+
+  usb_pickit_stats (g->d, &st);
+  usb_pickit_catch (g->d, NULL);
+
+  job->usec = st.usec ? st.usec - before : pickit_clock () - t0;
+  strcpy (job->result, job->ok ? "programmed, verified"
+	  : "programmed, FAILED to verify");
+
+  g->jobs++;
+  g->usec += job->usec;
+
+  gang_job_print (g, job);
+
+  return 1;
+}
+
+/*
+ * program and verify chips for jobs until there are none left.  the
+ * first job takes the chip already in the socket.
+ */
+static void *
+gang_job_worker (void *arg)
+{
+  gang_socket *g = (gang_socket *)arg;
+  gang_job *job;
+  bool swap = 0;
+
+  while ((job = gang_take (g)) != NULL)
+    {
+      if (!gang_job_run (g, job, swap))
+	break;
+
+      swap = 1;
+    }
+
+  return NULL;
+}
+
+/*
+ * print the jobs' and PICkits' results.  returns the number of jobs
+ * which failed.
+ */
+static int
+gang_jobs_report (gang_batch *batches, int nbatches, gang_job *jobs,
+		  int njobs, gang_socket *sockets, int n)
+{
+  unsigned long busiest = 0;
+  int i, j, failed = 0;
+
+  printf ("\nPICkit  device        jobs  stolen  busy\n");
+
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+      char device[16] = "-";
+
+      if (g->found)
+	sprintf (device, "%s rev %d", g->dev.dinfo->device_name,
+		 g->dev.rev);
+
+      if (g->started)
+	printf ("%6d  %-12s  %4d  %6d  %lu.%03lu s\n", g->unit, device,
+		g->jobs, g->stolen, g->usec / 1000000, g->usec / 1000 % 1000);
+      else
+	printf ("%6d  %-12s  %s\n", g->unit, device, g->result);
+
+      if (g->usec > busiest)
+	busiest = g->usec;
+    }
+
+  printf ("\n");
+
+  for (i = 0; i < nbatches; ++i)
+    {
+      gang_batch *b = &batches[i];
+      int ok = 0;
+
+      for (j = 0; j < njobs; ++j)
+	if (jobs[j].batch == b && jobs[j].ok)
+	  ok++;
+
+      printf ("line %d: %s on PIC%s, %d of %d chips done\n", b->line,
+	      b->filename, b->file.dinfo->device_name, ok, b->count);
+    }
+
+  for (j = 0; j < njobs; ++j)
+    if (!jobs[j].ok)
+      {
+	if (jobs[j].unit >= 0)
+	  printf ("%s chip %d on PICkit %d: %s\n", jobs[j].batch->filename,
+		  jobs[j].chip + 1, jobs[j].unit, jobs[j].result);
+	else
+	  printf ("%s chip %d: %s\n", jobs[j].batch->filename,
+		  jobs[j].chip + 1, jobs[j].result);
+	failed++;
+      }
+
+  printf ("%d of %d jobs succeeded, %lu.%03lu s on the busiest PICkit\n",
+	  njobs - failed, njobs, busiest / 1000000, busiest / 1000 % 1000);
+
+  return failed;
+}
+
+/*
+ * run a job file.
+ */
+int
+gang_jobs (const char *jobfile, const char *cache_dir, int max_errors,
+	   int poll, int timeout)
+{
+  gang_batch *batches = NULL;
+  gang_job *jobs = NULL;
+  gang_socket *sockets;
+  gang_sched sched;
+  pic14_arena arena;
+  int i, j, k, n, nbatches, njobs = 0, ok = 0;
+
+  if (poll <= 0 || timeout <= 0)
+    {
+      fprintf (stderr, "Error: --poll and --timeout must be at least 1\n");
+      return 0;
+    }
+
+  nbatches = gang_read_jobs (jobfile, &batches);
+  if (nbatches < 0)
+    return 0;
+
+  for (i = 0; i < nbatches; ++i)
+    njobs += batches[i].count;
+
+  n = usb_pickit_count ();
+  if (n <= 0)
+    {
+      fprintf (stderr, "Could not find any PICKit\n");
+      goto done;
+    }
+
+  printf ("%d jobs for %d PICkits\n", njobs, n);
+
+  sockets = gang_open (n);
+  if (!sockets)
+    goto done;
+
+  jobs = (gang_job *)calloc (njobs ? njobs : 1, sizeof (gang_job));
+  if (!jobs)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      gang_close (sockets, n);
+      goto done;
+    }
+
+  sched.sockets = sockets;
+  sched.n = n;
+  sched.max_errors = max_errors;
+  sched.poll = poll;
+  sched.timeout = timeout;
+  pthread_mutex_init (&sched.print, NULL);
+
+  /* every PICkit holding a chip of a type some job asks for gets a
+     queue, big enough for all the jobs */
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+
+      for (k = 0; g->found && k < nbatches; ++k)
+	if (batches[k].file.dinfo == g->dev.dinfo)
+	  break;
+
+      if (!g->found)
+	continue;
+
+      if (k == nbatches)
+	{
+	  strcpy (g->result, "no job for this chip");
+	  continue;
+	}
+
+      g->queue = (gang_job **)malloc (njobs * sizeof (gang_job *));
+      if (!g->queue)
+	{
+	  strcpy (g->result, "out of memory");
+	  continue;
+	}
+
+      g->sched = &sched;
+      pthread_mutex_init (&g->lock, NULL);
+    }
+
+  /* parse each .hex file once, and deal its chips out to the
+     PICkits with the shortest queues */
+  pic14_arena_init (&arena);
+
+  for (i = 0, j = 0; i < nbatches; ++i)
+    {
+      gang_batch *b = &batches[i];
+      const pic14_device_info *dinfo = b->file.dinfo;
+      bool held = 0;
+
+      for (k = 0; k < n; ++k)
+	if (sockets[k].queue && sockets[k].dev.dinfo == dinfo)
+	  held = 1;
+
+      if (held)
+	b->parsed = gang_image (&b->file, dinfo, b->filename, cache_dir,
+				&arena);
+
+      for (k = 0; k < b->count; ++k, ++j)
+	{
+	  gang_socket *to = NULL;
+	  int m;
+
+	  jobs[j].batch = b;
+	  jobs[j].chip = k;
+	  jobs[j].unit = -1;
+
+	  if (!held)
+	    {
+	      sprintf (jobs[j].result, "no PICkit holds a PIC%s",
+		       dinfo->device_name);
+	      continue;
+	    }
+
+	  if (!b->parsed)
+	    {
+	      strcpy (jobs[j].result, "could not read the .hex file");
+	      continue;
+	    }
+
+	  strcpy (jobs[j].result, "not done");
+
+	  for (m = 0; m < n; ++m)
+	    if (sockets[m].queue && sockets[m].dev.dinfo == dinfo
+		&& (!to || sockets[m].tail < to->tail))
+	      to = &sockets[m];
+
+	  to->queue[to->tail++] = &jobs[j];
+	}
+    }
+
+  /* one thread per PICkit with a queue, even an empty one: it may
+     steal */
+  for (i = 0; i < n; ++i)
+    {
+      gang_socket *g = &sockets[i];
+
+      if (!g->queue)
+	continue;
+
+      usb_pickit_quiet (g->d, 1);
+
+      if (pthread_create (&g->thread, NULL, gang_job_worker, g) != 0)
+	{
+	  strcpy (g->result, "could not start a thread");
+	  continue;
+	}
+
+      g->started = 1;
+    }
+
+  /* jobs left in the queue of a PICkit without a thread are stolen
+     by the others, if there are any */
+  for (i = 0; i < n; ++i)
+    if (sockets[i].started)
+      pthread_join (sockets[i].thread, NULL);
+
+  ok = gang_jobs_report (batches, nbatches, jobs, njobs, sockets, n) == 0;
+
+  for (i = 0; i < n; ++i)
+    if (sockets[i].queue)
+      {
+	pthread_mutex_destroy (&sockets[i].lock);
+	free (sockets[i].queue);
+      }
+
+  pthread_mutex_destroy (&sched.print);
+  gang_close (sockets, n);
+  pic14_arena_free (&arena);
+  free (jobs);
+
+ done:
+  for (i = 0; i < nbatches; ++i)
+    free (batches[i].filename);
+  free (batches);
+
+  return ok;
+}
@@ -0,0 +1,47 @@
+/*
+ * gang.h
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Gang programming: one .hex file on every attached PICkit at once,
+ * or a queue of jobs dealt out to them.
+ */
+
+#ifndef __GANG_H__
+#define __GANG_H__
+
+/* what a gang does on each PICkit */
+#define GANG_PROGRAM 0x01 /* write the .hex file, keeping OSCCAL and BG */
+#define GANG_UPDATE  0x02 /* only write chips which don't hold it yet */
+#define GANG_VERIFY  0x04 /* compare the chip with the .hex file */
+
+/*
+ * open every attached PICkit and do the same thing on all of them,
+ * one thread each, with the .hex file filename parsed once (through
+ * the cache directory cache_dir if not NULL).  the chips must all be
+ * of the type found first.  verify stops after max_errors mismatches
+ * (<= 0: no limit).  each PICkit's result is printed at the end.
+ * returns non-zero value if all PICkits succeeded.
+ */
+int gang_run (const char *filename, const char *cache_dir,
+	      unsigned int what, int max_errors);
+
+/*
+ * run the jobs of the file jobfile on every attached PICkit at once.
+ * each line of the file asks for a number of chips of a type to be
+ * programmed with a .hex file: "<device> <file> [<count>]", such as
+ * "12F675 blink.hex 10".  each job programs and verifies a chip in
+ * the socket of an idle PICkit holding that type of chip: the chip
+ * found there for its first job, then a new chip put in, looked for
+ * every poll ms.  a PICkit which gets none within timeout s stops.
+ * returns non-zero value if all jobs succeeded.
+ */
+int gang_jobs (const char *jobfile, const char *cache_dir, int max_errors,
+	       int poll, int timeout);
+
+#endif /* __GANG_H__ */
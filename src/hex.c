@@ -15,10 +15,16 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include "hex.h"
 
 #define HEX_MAX_BYTES 16
 #define HEX_MAX_DATA_LINE 64
+#define HEX_READ_CHUNK 16384
+
+/* longest data line, with ':' and newline, and lines written at once */
+#define HEX_LINE_LEN (1 + 2 * (4 + HEX_MAX_BYTES + 1) + 1)
+#define HEX_WRITE_LINES 64
 
 /*
  * begin writing a .hex file here.
@@ -31,60 +37,85 @@ hex_write_begin (FILE *fp)
 }
 
 /*
- * write this byte, updating checksum.
+ * upper case hex digits, as written to .hex files.
  */
-void
-hex_write_byte (FILE *fp, unsigned int bi, byte *checksum)
+static const char hex_upper[16] = {
+  '0', '1', '2', '3', '4', '5', '6', '7',
+  '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+/*
+ * format this byte at p, updating checksum.  returns the end of it.
+ */
+static char *
+hex_put_byte (char *p, byte b, byte *checksum)
 {
-  byte b = (byte)(0xff & bi);
-  fprintf (fp, "%02X", (int)b);
+  p[0] = hex_upper[b >> 4];
+  p[1] = hex_upper[b & 0x0f];
   *checksum -= b;
+
+  return p + 2;
+}
+
+/*
+ * format one data line of at most HEX_MAX_BYTES bytes at p.
+ * returns the end of it.
+ */
+static char *
+hex_put_line (char *p, unsigned int addr, unsigned int len,
+	      const byte *data)
+{
+  unsigned int i;
+  byte checksum = 0;
+
+  /* line's header */
+  *p++ = ':';
+  p = hex_put_byte (p, (byte)len, &checksum);
+  p = hex_put_byte (p, (byte)(addr >> 8), &checksum);
+  p = hex_put_byte (p, (byte)addr, &checksum);
+  p = hex_put_byte (p, 0x00, &checksum);
+
+  /* the data */
+  for (i = 0; i < len; ++i)
+    p = hex_put_byte (p, data[i], &checksum);
+
+  /* the checksum */
+  p = hex_put_byte (p, checksum, &checksum);
+  *p++ = '\n';
+
+  return p;
 }
 
 /*
  * write data to the .hex file at the given address.
  * can write any number of bytes of data -- splits lines internally.
+ * lines are formatted into a buffer, which is written in one go
+ * whenever it is full.
  */
 void
 hex_write (FILE *fp, unsigned int addr, unsigned int len, byte *data)
 {
-  if (len <= HEX_MAX_BYTES)
-    {
-      /* write out one line */
-      unsigned int i;
-      byte checksum = 0;
-
-      /* write line's header */
-      fprintf (fp, ":");
-      hex_write_byte (fp, len, &checksum);
-      hex_write_byte (fp, addr >> 8, &checksum);
-      hex_write_byte (fp, addr, &checksum);
-      hex_write_byte (fp, 0x00, &checksum);
-
-      /* write the data */
-      for (i = 0; i < len; ++i)
-	hex_write_byte (fp, data[i], &checksum);
-
-      /* write the checksum */
-      hex_write_byte (fp, checksum, &checksum);
-      fprintf (fp, "\n");
-    }
-  else
+  char buffer[HEX_WRITE_LINES * HEX_LINE_LEN], *p = buffer;
+
+  do
     {
-      /* len is too long -- split into smaller lines */
-      while (len > 0)
-	{
-	  int n = len;
-	  if (n > HEX_MAX_BYTES)
-	    n = HEX_MAX_BYTES;
+      unsigned int n = len;
+      if (n > HEX_MAX_BYTES)
+	n = HEX_MAX_BYTES;
+
+      p = hex_put_line (p, addr, n, data);
 
-	  hex_write (fp, addr, n, data);
+      addr += n;
+      len -= n;
+      data += n;
 
-	  addr += n;
-	  len -= n;
-	  data += n;
+      if (len == 0 || p + HEX_LINE_LEN > buffer + sizeof (buffer))
+	{
+	  fwrite (buffer, 1, p - buffer, fp);
+	  p = buffer;
 	}
     }
+  while (len > 0);
 }
 
 /*
@@ -98,67 +129,170 @@ hex_write_end (FILE *fp)
 }
 
 /*
- * read a .hex file from here, sending the resulting
- * address spans to this function.  return non-zero value if success.
+ * value of each character as a hex digit, -1 if it isn't one.
  */
-int
-hex_read (FILE *fp, hex_dest_fn fn, void *param)
+static const signed char hex_digit[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/*
+ * decode the two hex digits at p, return -1 if they aren't.
+ */
+static int
+hex_byte (const byte *p)
 {
-  unsigned int addrbase16 = 0; /* DOS-style "segment" of program */
-  unsigned int addrbase32 = 0; /* high 16 bits of program counter */
+  int hi = hex_digit[p[0]], lo = hex_digit[p[1]];
+
+  if (hi < 0 || lo < 0)
+    return -1;
+
+  return (hi << 4) | lo;
+}
+
+/*
+ * read a whole .hex file into memory.  returns the malloc'ed text,
+ * and its length in *lenp, or NULL on errors.
+ */
+char *
+hex_slurp (FILE *fp, size_t *lenp)
+{
+  char *text = NULL, *grow;
+  size_t len = 0, size = 0, n;
 
   if (!fp)
     {
       fprintf (stderr, "Error reading .hex file: "
 	       "could not open file!\n");
-      return 0;
+      return NULL;
     }
 
+  /* slurp the file: its size may not be known (pipes) */
+  do
+    {
+      if (len == size)
+	{
+	  size = size ? 2 * size : HEX_READ_CHUNK;
+	  grow = (char *)realloc (text, size);
+	  if (!grow)
+	    {
+	      fprintf (stderr, "Error reading .hex file: "
+		       "out of memory!\n");
+	      free (text);
+	      return NULL;
+	    }
+	  text = grow;
+	}
+
+      n = fread (text + len, 1, size - len, fp);
+      len += n;
+    }
+  while (n > 0);
+
+  if (ferror (fp))
+    {
+      fprintf (stderr, "Error reading .hex file: "
+	       "could not read file!\n");
+      free (text);
+      return NULL;
+    }
+
+  *lenp = len;
+  return text;
+}
+
+/*
+ * read a .hex file from here, sending the resulting
+ * address spans to this function.  return non-zero value if success.
+ * the whole file is read first, then parsed from memory.
+ */
+int
+hex_read (FILE *fp, hex_dest_fn fn, void *param)
+{
+  char *text;
+  size_t len;
+  int ok;
+
+  text = hex_slurp (fp, &len);
+  if (!text)
+    return 0;
+
+  ok = hex_read_buffer (text, len, fn, param);
+  free (text);
+
+  return ok;
+}
+
+/*
+ * parse a .hex file held in memory, sending the resulting address
+ * spans to this function.  return non-zero value if success.
+ */
+int
+hex_read_buffer (const char *text, size_t size,
+		 hex_dest_fn fn, void *param)
+{
+  const byte *p = (const byte *)text, *end = p + size;
+  unsigned int addrbase16 = 0; /* DOS-style "segment" of program */
+  unsigned int addrbase32 = 0; /* high 16 bits of program counter */
+
   while (1)
     {
       /*
-       * read one line of the .hex file:
+       * decode one line of the .hex file:
        *  : <len> <addr hi> <addr lo> <type> [ < data > ] <checksum>
        */
-      unsigned int addr, i, v, len, type, checksum = 0;
+      unsigned int addr, i, len, type, checksum;
+      int v, hi, lo, t;
       byte data[HEX_MAX_DATA_LINE + 1];
 
       /* seek to start of next line */
-      int ic;
-      while (EOF != (ic = fgetc (fp)))
+      while (p < end && *p != ':')
 	{
-	  char c = (char)ic;
-
-	  if (c == ':')
-	    {
-	      /* start of next line */
-	      break;
-	    }
-	  else if (!isspace (c))
+	  if (!isspace (*p))
 	    {
 	      fprintf (stderr, "Error reading .hex file: "
 		       "unexpected characters!\n");
 	      return 0;
 	    }
+	  p++;
 	}
 
-      if (ic == EOF)
+      if (p == end)
 	{
 	  /* hit EOF */
 	  return 1;
 	}
+      p++;
 
       /* read address and length of line */
-      if (3 != fscanf (fp, "%02x%04x%02x", &len, &addr, &type))
+      if (end - p < 8 ||
+	  (v = hex_byte (p)) < 0 || (hi = hex_byte (p + 2)) < 0 ||
+	  (lo = hex_byte (p + 4)) < 0 || (t = hex_byte (p + 6)) < 0)
 	{
 	  fprintf (stderr, "Error reading .hex file: "
 		   "unexpected start-of-line format!\n");
 	  return 0;
 	}
+      p += 8;
 
-      checksum += len;
-      checksum += addr + (addr >> 8);
-      checksum += type;
+      len = v;
+      addr = (hi << 8) | lo;
+      type = t;
+      checksum = len + hi + lo + type;
 
       /* ensure line lenght is not too long */
       if (len > HEX_MAX_DATA_LINE)
@@ -168,10 +302,17 @@ hex_read (FILE *fp, hex_dest_fn fn, void *param)
 	  return 0;
 	}
 
-      /* read data and checksum for line */
-      for (i = 0; i < len + 1; ++i)
+      /* decode data and checksum for line */
+      if ((size_t)(end - p) < 2 * (len + 1))
+	{
+	  fprintf (stderr, "Error reading .hex file: "
+		   "unexpected data format!\n");
+	  return 0;
+	}
+
+      for (i = 0; i < len + 1; ++i, p += 2)
 	{
-	  if (1 != fscanf (fp, "%02x", &v))
+	  if ((v = hex_byte (p)) < 0)
 	    {
 	      fprintf (stderr, "Error reading .hex file: "
 		       "unexpected data format!\n");
@@ -220,7 +361,6 @@ hex_read (FILE *fp, hex_dest_fn fn, void *param)
 }
 
 #ifdef TEST_HEX
-#include <stdlib.h>
 
 /*
  * test out .hex file reading and writing, by using the reader
@@ -253,3 +393,81 @@ main (int argc, char *argv[])
   return 0;
 }
 #endif /* TEST_HEX */
+
+#ifdef BENCH_HEX
+#include <time.h>
+
+static unsigned long bench_bytes;
+
+/*
+ * count the bytes read back.
+ */
+static void
+bench_count (void *param, unsigned int addr, unsigned int len, byte *data)
+{
+  bench_bytes += len;
+}
+
+/*
+ * measure .hex writing and reading speed, in records per second,
+ * with a file of random data records.
+ */
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, records = 1000000;
+  byte data[HEX_MAX_BYTES];
+  clock_t start;
+  double t;
+  FILE *fp;
+
+  if (argc != 2 && argc != 3)
+    {
+      printf ("usage: %s <scratch file> [records]\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+
+  if (argc == 3)
+    records = strtoul (argv[2], NULL, 0);
+
+  fp = fopen (argv[1], "w");
+  if (!fp)
+    {
+      perror ("Could not create scratch file");
+      exit (EXIT_FAILURE);
+    }
+
+  /* write */
+  start = clock ();
+  hex_write_begin (fp);
+
+  for (i = 0; i < records; ++i)
+    {
+      data[i % HEX_MAX_BYTES] = (byte)rand ();
+      hex_write (fp, (unsigned int)(i * HEX_MAX_BYTES), HEX_MAX_BYTES, data);
+    }
+
+  hex_write_end (fp);
+  fclose (fp);
+
+  t = (double)(clock () - start) / CLOCKS_PER_SEC;
+  printf ("write: %lu records in %.3f s, %.0f records/s\n",
+	  records, t, t > 0 ? records / t : 0.0);
+
+  /* read back */
+  fp = fopen (argv[1], "r");
+  start = clock ();
+
+  if (!hex_read (fp, bench_count, NULL))
+    exit (EXIT_FAILURE);
+
+  t = (double)(clock () - start) / CLOCKS_PER_SEC;
+  fclose (fp);
+
+  printf ("read:  %lu records in %.3f s, %.0f records/s\n",
+	  bench_bytes / HEX_MAX_BYTES, t,
+	  t > 0 ? bench_bytes / HEX_MAX_BYTES / t : 0.0);
+
+  return 0;
+}
+#endif /* BENCH_HEX */
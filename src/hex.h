@@ -54,4 +54,16 @@ typedef void (*hex_dest_fn)(void *param, unsigned int addr,
  */
 int hex_read (FILE *fp, hex_dest_fn fn, void *param);
 
+/*
+ * read a whole .hex file into memory.  returns the text, to be
+ * free'd, and its length in *lenp; or NULL on errors.
+ */
+char *hex_slurp (FILE *fp, size_t *lenp);
+
+/*
+ * same as hex_read, for a .hex file already in memory.
+ */
+int hex_read_buffer (const char *text, size_t size,
+		     hex_dest_fn fn, void *param);
+
 #endif /* __HEX_H__ */
@@ -16,6 +16,8 @@
  * microcontrollers, such as the PIC 12F675 or the PIC 16F684.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "pic14.h"
 #include "hex.h"
@@ -32,6 +34,42 @@ typedef struct
 
 } pic14_span;
 
+/* words converted at once when writing a .hex file: a whole number
+   of 16-byte .hex lines */
+#define PIC14_HEX_CHUNK 64
+
+/* word addresses routed to spans when loading: up to the end of
+   EEPROM, at 0x2100 */
+#define PIC14_ROUTE_LEN (0x2100 + PIC14_EE_LEN)
+#define PIC14_NO_SPAN 0xff
+
+/*
+ * one chunk of an arena, followed by its memory.
+ */
+struct pic14_arena_chunk
+{
+  pic14_arena_chunk *next;
+  size_t size; /* bytes of memory */
+  size_t used; /* bytes handed out */
+};
+
+/* something an arena releases when freed */
+struct pic14_arena_held
+{
+  pic14_arena_held *next;
+  void *addr;
+  size_t len;
+  void (*release) (void *addr, size_t len);
+};
+
+/* arena chunk size, enough for a few small device images, and the
+   alignment of the pieces */
+#define PIC14_ARENA_CHUNK 16384
+#define PIC14_ARENA_ROUND(n) (((n) + 7) & ~(size_t)7)
+
+/* where states without an arena get their memory */
+static pic14_arena pic14_default_arena = { NULL, NULL };
+
 /* list of spans */
 enum {
   SPAN_PROGRAM,
@@ -52,13 +90,15 @@ pic14_state_init (pic14_state *p)
 {
   unsigned int i;
 
-  /* clear program memory */
-  for (i = 0; i < PIC14_INST_LEN; ++i)
-    p->program.inst[i] = 0x3fff;
+  /* no program or EEPROM memory until the device is known */
+  p->program.inst_len = 0;
+  p->program.inst = NULL;
+  p->program.inst_map = NULL;
 
-  /* clear EEPROM data memory */
-  for (i = 0; i < PIC14_EE_LEN; ++i)
-    p->program.ee[i] = 0xff;
+  p->program.ee_len = 0;
+  p->program.ee = NULL;
+  p->program.ee_map = NULL;
+  p->program.summed = 0;
 
   /* currently no data to write */
   p->program.max_prog = 0;
@@ -79,6 +119,176 @@ pic14_state_init (pic14_state *p)
     p->config.id[i] = 0x3fff;
 
   p->config.osccal = 0x2000;
+  p->config.defined = 0;
+
+  memset (&p->load, 0, sizeof (p->load));
+  p->arena = NULL;
+}
+
+/*
+ * give program and EEPROM memory of this size to the state, blank,
+ * in one piece of its arena.
+ */
+int
+pic14_state_size (pic14_state *p, pic14_addr inst_len, pic14_addr ee_len)
+{
+  pic14_program *g = &p->program;
+  pic14_addr i, inst_room = (inst_len + 3) / 4 * 4;
+  byte *block;
+
+  block = (byte *)pic14_arena_alloc (p->arena,
+				     sizeof (pic14_word) * (inst_room + ee_len)
+				     + PIC14_MAP_LEN (inst_len)
+				     + PIC14_MAP_LEN (ee_len));
+  if (!block)
+    {
+      fprintf (stderr, "Error: out of memory for the device image!\n");
+      return 0;
+    }
+
+  g->inst_len = inst_len;
+  g->inst = (pic14_word *)block;
+  g->ee_len = ee_len;
+  g->ee = g->inst + inst_room;
+  g->inst_map = (byte *)(g->ee + ee_len);
+  g->ee_map = g->inst_map + PIC14_MAP_LEN (inst_len);
+  g->summed = 0;
+
+  /* clear program memory */
+  for (i = 0; i < inst_room; ++i)
+    g->inst[i] = 0x3fff;
+
+  /* clear EEPROM data memory */
+  for (i = 0; i < ee_len; ++i)
+    g->ee[i] = 0xff;
+
+  memset (g->inst_map, 0, PIC14_MAP_LEN (inst_len));
+  memset (g->ee_map, 0, PIC14_MAP_LEN (ee_len));
+
+  return 1;
+}
+
+/*
+ * initialize an empty arena.
+ */
+void
+pic14_arena_init (pic14_arena *a)
+{
+  a->chunks = NULL;
+  a->held = NULL;
+}
+
+/*
+ * get size bytes from the arena (NULL: the default one), from its
+ * current chunk if they fit in it, else from a new one.
+ */
+void *
+pic14_arena_alloc (pic14_arena *a, size_t size)
+{
+  pic14_arena_chunk *c;
+  size_t head = PIC14_ARENA_ROUND (sizeof (pic14_arena_chunk));
+  void *piece;
+
+  if (!a)
+    a = &pic14_default_arena;
+
+  c = a->chunks;
+
+  size = PIC14_ARENA_ROUND (size);
+
+  if (!c || c->used + size > c->size)
+    {
+      size_t csize = size > PIC14_ARENA_CHUNK ? size : PIC14_ARENA_CHUNK;
+
+      c = (pic14_arena_chunk *)malloc (head + csize);
+      if (!c)
+	return NULL;
+
+      c->size = csize;
+      c->used = 0;
+      c->next = a->chunks;
+      a->chunks = c;
+    }
+
+  piece = (byte *)c + head + c->used;
+  c->used += size;
+
+  return piece;
+}
+
+/*
+ * hold memory the arena releases when freed.  the record of it is
+ * carved from the arena itself.
+ */
+int
+pic14_arena_hold (pic14_arena *a, void *addr, size_t len,
+		  void (*release) (void *addr, size_t len))
+{
+  pic14_arena_held *h;
+
+  if (!a)
+    a = &pic14_default_arena;
+
+  h = (pic14_arena_held *)pic14_arena_alloc (a, sizeof (pic14_arena_held));
+  if (!h)
+    return 0;
+
+  h->addr = addr;
+  h->len = len;
+  h->release = release;
+  h->next = a->held;
+  a->held = h;
+
+  return 1;
+}
+
+/*
+ * free everything allocated from the arena.
+ */
+void
+pic14_arena_free (pic14_arena *a)
+{
+  /* the records live in the chunks: release before freeing them */
+  for (; a->held; a->held = a->held->next)
+    a->held->release (a->held->addr, a->held->len);
+
+  while (a->chunks)
+    {
+      pic14_arena_chunk *next = a->chunks->next;
+
+      free (a->chunks);
+      a->chunks = next;
+    }
+}
+
+/*
+ * find the next run of set addresses in a coverage map.
+ */
+int
+pic14_map_extent (const byte *map, pic14_addr len, pic14_addr gap,
+		  pic14_addr *addr, pic14_addr *count)
+{
+  pic14_addr a = *addr, end, next;
+
+  /* skip unset addresses */
+  while (a < len && !PIC14_MAP_TEST (map, a))
+    a++;
+
+  if (a >= len)
+    return 0;
+
+  /* extend the run, also over short holes */
+  end = a;
+  for (next = a; next < len && next - end <= gap; ++next)
+    {
+      if (PIC14_MAP_TEST (map, next))
+	end = next + 1;
+    }
+
+  *addr = a;
+  *count = end - a;
+
+  return 1;
 }
 
 /*
@@ -143,87 +353,265 @@ pic14_program_spans (pic14_state *p, pic14_span s[])
 }
 
 /*
- * write this word wherever it belongs in this span list.
+ * everything needed to load .hex records into a state, built once
+ * per load: its spans, and which span each word address belongs to.
  */
-void
-pic14_write_word (pic14_span *spans, unsigned int addr,
-		  pic14_word w, pic14_state *p)
+typedef struct
 {
-  unsigned int s;
-  unsigned int index;
+  pic14_state *state;
+  pic14_span spans[PIC14_PROGRAM_NSPANS];
+  byte route[PIC14_ROUTE_LEN]; /* span number, or PIC14_NO_SPAN */
 
-  /* look for the span of this word */
-  for (s = 0; s < PIC14_PROGRAM_NSPANS; ++s)
+} pic14_loader;
+
+/*
+ * build the loader of this state.
+ */
+static void
+pic14_loader_init (pic14_loader *l, pic14_state *p)
+{
+  pic14_addr a, end;
+  int s;
+
+  l->state = p;
+  p->program.summed = 0;
+  pic14_program_spans (p, l->spans);
+  memset (l->route, PIC14_NO_SPAN, sizeof (l->route));
+
+  /* where spans overlap (OSCCAL inside bigger program memories),
+     the first one wins: route the others first */
+  for (s = PIC14_PROGRAM_NSPANS - 1; s >= 0; --s)
     {
-      if ((addr >= spans[s].addr) &&
-	  (addr < spans[s].addr + spans[s].len))
-	{
-	  /* this is our span, write us into it */
-	  index = addr - spans[s].addr;
-	  spans[s].data[index] = w;
-
-	  /* go from index of last element (0-based) to length (count
-	     from 1) */
-	  index++;
-
-	  switch (s)
-	    {
-	    case SPAN_PROGRAM:
-	      if (index > p->program.max_prog)
-		p->program.max_prog = index;
-	      break;
-
-	    case SPAN_EEPROM:
-	      if (index > p->program.max_ee)
-		p->program.max_ee = index;
-	      break;
-
-	    case SPAN_CONFIG:
-	      /*
-	       * JEB - print a message to let the user know that a
-	       * config word was found in the .HEX file.
-	       * this is based on a recommendation from Microchop to
-	       * let the user know about where there config value
-	       * comes from.
-	       */
-	      printf (".hex file contains a configuration word\n");
-	      break;
-	    }
-
-	  return;
-	}
+      end = l->spans[s].addr + l->spans[s].len;
+      if (end > PIC14_ROUTE_LEN)
+	end = PIC14_ROUTE_LEN;
+
+      for (a = l->spans[s].addr; a < end; ++a)
+	l->route[a] = (byte)s;
+    }
+}
+
+/*
+ * mark n addresses from a as defined in a coverage map.  returns how
+ * many of them already were.
+ */
+static unsigned int
+pic14_map_mark (byte *map, pic14_addr a, unsigned int n)
+{
+  unsigned int twice = 0;
+
+  for (; n > 0; --n, ++a)
+    {
+      if (PIC14_MAP_TEST (map, a))
+	twice++;
+      PIC14_MAP_SET (map, a);
+    }
+
+  return twice;
+}
+
+/*
+ * mark these bits of the configuration words as defined.  returns
+ * how many of them already were.
+ */
+static unsigned int
+pic14_config_mark (pic14_config *c, byte bits)
+{
+  unsigned int i, twice = 0;
+
+  for (i = 0; i < 8; ++i)
+    {
+      if (bits & c->defined & (1 << i))
+	twice++;
+    }
+
+  c->defined |= bits;
+
+  return twice;
+}
+
+/*
+ * copy n words, stored as bytes in src, to span s of the loader at
+ * index, and account for them.  the words must all lie in the span.
+ */
+static void
+pic14_loader_copy (pic14_loader *l, int s, pic14_addr index,
+		   unsigned int n, const byte *src)
+{
+  pic14_state *p = l->state;
+  pic14_load_stats *st = &p->load;
+  pic14_word *dest = l->spans[s].data + index;
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+    dest[i] = src[2 * i + 0] + (src[2 * i + 1] << 8);
+
+  switch (s)
+    {
+    case SPAN_PROGRAM:
+      st->program += n;
+      st->overlaps += pic14_map_mark (p->program.inst_map, index, n);
+      if (index + n > p->program.max_prog)
+	p->program.max_prog = index + n;
+      break;
+
+    case SPAN_EEPROM:
+      st->eeprom += n;
+      st->overlaps += pic14_map_mark (p->program.ee_map, index, n);
+      if (index + n > p->program.max_ee)
+	p->program.max_ee = index + n;
+      break;
+
+    case SPAN_CONFIG:
+      /*
+       * JEB - print a message to let the user know that a
+       * config word was found in the .HEX file.
+       * this is based on a recommendation from Microchop to
+       * let the user know about where there config value
+       * comes from.
+       */
+      printf (".hex file contains a configuration word\n");
+      st->config += n;
+      st->overlaps += pic14_config_mark (&p->config, PIC14_DEFINED_CONFIG);
+      break;
+
+    case SPAN_USERID:
+      st->config += n;
+      st->overlaps += pic14_config_mark (&p->config,
+					 ((1 << n) - 1) << index);
+      break;
+
+    case SPAN_OSCCAL:
+      st->config += n;
+      st->overlaps += pic14_config_mark (&p->config, PIC14_DEFINED_OSCCAL);
+      break;
     }
 }
 
 /*
  * accept this segment of a pic14 program from a .hex file, in which
- * everything is stored as *bytes*, not words.
+ * everything is stored as *bytes*, not words.  each part of it that
+ * falls in one span is copied there at once.
  */
 static void
 pic14_hex_segment (void *vp, unsigned int baddr,
 		   unsigned int blen, byte *src)
 {
-  unsigned int i, addr = baddr/2, len = blen/2;
-  pic14_state *p = (pic14_state *)vp;
-  pic14_span spans[PIC14_PROGRAM_NSPANS];
-
-  pic14_program_spans (p, spans);
+  unsigned int addr = baddr/2, len = blen/2, n;
+  pic14_loader *l = (pic14_loader *)vp;
+  pic14_span *ps;
+  int s;
 
-  for (i = 0; i < len; ++i)
+  while (len > 0)
     {
-      pic14_write_word (spans, addr + i,
-	src[2 * i + 0] + (src[2 * i + 1] << 8), p);
+      s = (addr < PIC14_ROUTE_LEN) ? l->route[addr] : PIC14_NO_SPAN;
+
+      if (s == PIC14_NO_SPAN)
+	{
+	  /* not in the device's memory */
+	  l->state->load.outside++;
+	  n = 1;
+	}
+      else
+	{
+	  ps = &l->spans[s];
+	  n = ps->addr + ps->len - addr;
+	  if (n > len)
+	    n = len;
+
+	  pic14_loader_copy (l, s, addr - ps->addr, n, src);
+	}
+
+      addr += n;
+      len -= n;
+      src += 2 * n;
     }
 }
 
 /*
  * read a program from a .hex file.  Return non-zero value
- * if success.
+ * if success.  what was loaded where is kept in p->load, and
+ * reported.
  */
 int
 pic14_hex_read (pic14_state *p, FILE *src)
 {
-  return hex_read (src, pic14_hex_segment, p);
+  pic14_loader l;
+  int ok;
+
+  memset (&p->load, 0, sizeof (p->load));
+  pic14_loader_init (&l, p);
+
+  ok = hex_read (src, pic14_hex_segment, &l);
+
+  if (ok)
+    pic14_print_load_stats (&p->load);
+
+  return ok;
+}
+
+/*
+ * same as pic14_hex_read, for a .hex file already in memory.
+ */
+int
+pic14_hex_read_buffer (pic14_state *p, const char *text, size_t len)
+{
+  pic14_loader l;
+  int ok;
+
+  memset (&p->load, 0, sizeof (p->load));
+  pic14_loader_init (&l, p);
+
+  ok = hex_read_buffer (text, len, pic14_hex_segment, &l);
+
+  if (ok)
+    pic14_print_load_stats (&p->load);
+
+  return ok;
+}
+
+/*
+ * compute the checksum of program memory and CONFIG word, as the
+ * Microchip tools do, into p->program.instchecksum, and the sum of
+ * EEPROM data into p->program.eechecksum.
+ */
+void
+pic14_calc_checksum (pic14_state *s)
+{
+  unsigned int i;
+
+  /* add the CONFIG word to the checksum */
+  s->program.instchecksum = (s->config.config & s->config.configmask);
+
+  /* sum all instruction words */
+  for (i = 0; i < s->program.inst_len; ++i)
+    s->program.instchecksum += s->program.inst[i];
+
+  s->program.instchecksum &= 0xffff;
+
+  s->program.eechecksum = 0;
+  for (i = 0; i < s->program.ee_len; ++i)
+    s->program.eechecksum += s->program.ee[i];
+
+  s->program.summed = 1;
+}
+
+/*
+ * print what a .hex file load put where.
+ */
+void
+pic14_print_load_stats (const pic14_load_stats *st)
+{
+  printf (".hex file holds %u program words, %u EEPROM bytes and "
+	  "%u configuration words\n", st->program, st->eeprom, st->config);
+
+  if (st->outside)
+    fprintf (stderr, "Warning: %u .hex file words lie outside of the "
+	     "device's memory, ignored\n", st->outside);
+
+  if (st->overlaps)
+    fprintf (stderr, "Warning: %u .hex file words are defined more "
+	     "than once\n", st->overlaps);
 }
 
 /*
@@ -231,36 +619,132 @@ pic14_hex_read (pic14_state *p, FILE *src)
  */
 void
 pic14_hex_write (pic14_state *p, FILE *dest)
+{
+  pic14_hex_write_range (p, dest, NULL, NULL);
+}
+
+/*
+ * narrow a span down to a window of its addresses.
+ */
+static void
+pic14_span_clip (pic14_span *s, const pic14_range *r)
+{
+  if (!r)
+    return;
+
+  s->addr += r->addr;
+  s->data += r->addr;
+  s->len = r->len;
+}
+
+/*
+ * write a program to a .hex file, only the given windows of program
+ * and EEPROM memory.
+ */
+void
+pic14_hex_write_range (pic14_state *p, FILE *dest,
+		       const pic14_range *prog, const pic14_range *ee)
+{
+  pic14_hex_write_sparse (p, dest, prog, ee, 0);
+}
+
+/*
+ * write len words of data at word address addr to a .hex file.
+ * words are converted to bytes a chunk at a time, a whole number of
+ * .hex lines long, so that lines are split as for one big write.
+ */
+static void
+pic14_hex_write_words (FILE *dest, unsigned int addr, unsigned int len,
+		       const pic14_word *data)
+{
+  byte chunk[2 * PIC14_HEX_CHUNK];
+
+  do
+    {
+      unsigned int w, n = len;
+      if (n > PIC14_HEX_CHUNK)
+	n = PIC14_HEX_CHUNK;
+
+      /* Must convert address and data from words to bytes: */
+      for (w = 0; w < n; ++w)
+	{
+	  unsigned int v = data[w];
+
+	  chunk[2 * w + 0] = (byte)(0xff & v); /* Low end first */
+	  chunk[2 * w + 1] = (byte)(0xff & (v >> 8)); /* High end second */
+	}
+
+      hex_write (dest, 2 * addr, 2 * n, chunk);
+
+      addr += n;
+      data += n;
+      len -= n;
+    }
+  while (len > 0);
+}
+
+/*
+ * write a program to a .hex file, only the given windows of program
+ * and EEPROM memory.  with gap set, runs of at least gap blank words
+ * are left out of program and EEPROM memory; shorter ones are written
+ * so that records don't get fragmented.  the configuration words are
+ * always written, and OSCCAL when it isn't inside program memory.
+ */
+void
+pic14_hex_write_sparse (pic14_state *p, FILE *dest,
+			const pic14_range *prog, const pic14_range *ee,
+			pic14_addr gap)
 {
   pic14_span spans[PIC14_PROGRAM_NSPANS];
   int s;
 
   pic14_program_spans (p, spans);
+  pic14_span_clip (&spans[SPAN_PROGRAM], prog);
+  pic14_span_clip (&spans[SPAN_EEPROM], ee);
+
   hex_write_begin (dest);
 
   for (s = 0; s < PIC14_PROGRAM_NSPANS; ++s)
     {
-      /* Must convert address and data from words to bytes: */
-      byte data[2 * PIC14_INST_LEN];
-      unsigned int addr = 2 * spans[s].addr;
-      unsigned int w, len = 2 * spans[s].len;
+      pic14_span *ps = &spans[s];
+      pic14_word blank = (s == SPAN_EEPROM) ? 0xff : 0x3fff;
+      unsigned int start, end, hole;
 
-      for (w = 0; w < spans[s].len; ++w)
-	{
-	  unsigned int v = spans[s].data[w];
+      /* 0x3ff is a program word, not OSCCAL, on bigger devices */
+      if (s == SPAN_OSCCAL && p->program.inst_len > ps->addr)
+	continue;
 
-	  data[2 * w + 0] = (byte)(0xff & v); /* Low end first */
-	  data[2 * w + 1] = (byte)(0xff & (v >> 8)); /* High end second */
+      if (gap == 0 || (s != SPAN_PROGRAM && s != SPAN_EEPROM))
+	{
+	  pic14_hex_write_words (dest, ps->addr, ps->len, ps->data);
+	  continue;
 	}
 
-      hex_write (dest, addr, len, data);
+      for (start = 0; start < ps->len; start = end)
+	{
+	  /* skip to the next non-blank word */
+	  while (start < ps->len && ps->data[start] == blank)
+	    start++;
+
+	  if (start == ps->len)
+	    break;
+
+	  /* extend the run until a hole of gap blank words */
+	  for (end = start + 1, hole = 0;
+	       end < ps->len && hole < gap; ++end)
+	    hole = (ps->data[end] == blank) ? hole + 1 : 0;
+
+	  end -= hole;
+
+	  pic14_hex_write_words (dest, ps->addr + start, end - start,
+				 ps->data + start);
+	}
     }
 
   hex_write_end (dest);
 }
 
 #ifdef TEST_PIC_HEX
-#include <stdlib.h>
 
 /*
  * test out pic14 .hex file reading and writing, by using the reader
@@ -281,7 +765,9 @@ main (int argc, char *argv[])
   src = fopen (argv[1], "r");
   dest = fopen (argv[2], "w");
 
-  pic14_state_init (&dfile.state);
+  pic14_state_init (&p);
+  if (!pic14_state_size (&p, PIC14_INST_LEN, PIC14_EE_LEN))
+    return 1;
 
   if (!pic14_hex_read (&p, src))
     {
@@ -37,35 +37,87 @@ typedef unsigned short pic14_word;
 typedef unsigned int pic14_addr;
 
 
+/*
+ * memory that device images are carved from.  pieces are not freed
+ * one by one: the whole arena is freed at once, along with what it
+ * was handed to release, such as mapped image files.
+ */
+typedef struct pic14_arena_chunk pic14_arena_chunk;
+typedef struct pic14_arena_held pic14_arena_held;
+
+typedef struct
+{
+  pic14_arena_chunk *chunks; /* most recent first */
+  pic14_arena_held *held; /* released when the arena is freed */
+
+} pic14_arena;
+
+/* initialize an empty arena */
+void pic14_arena_init (pic14_arena *a);
+
+/* get size bytes from the arena (NULL: the default arena), NULL if
+   out of memory */
+void *pic14_arena_alloc (pic14_arena *a, size_t size);
+
+/* have release (addr, len) called when the arena (NULL: the default
+   arena) is freed, for memory which does not come from it, such as
+   a mapped file.  returns 0 if out of memory */
+int pic14_arena_hold (pic14_arena *a, void *addr, size_t len,
+		      void (*release) (void *addr, size_t len));
+
+/* free everything allocated from the arena, and release what it
+   holds */
+void pic14_arena_free (pic14_arena *a);
+
+
 /*
  * program state for pic14-series microcontroller.
  * contains two distinct regions: program memory region (composed of
  * 14-bit word instructions) and EEPROM data memory region (composed
- * of 8-bit bytes).
+ * of 8-bit bytes).  both are sized for the device by
+ * pic14_state_size.
  */
 typedef struct
 {
   /* JEB - changed from 0x0fff to 0x01fff to go up to 8K for newer
      devices */
-#define PIC14_INST_LEN 0x01fff /* up to 8192 words of program */
+#define PIC14_INST_LEN 0x02000 /* up to 8192 words of program */
 
-  /* regular program memory runs from 0x0000 to 0x0fff. */
+  /* regular program memory runs from 0x0000 to inst_len - 1.  there
+     is room for inst_len rounded up to 4 words, as read by 'R' */
   pic14_addr inst_len;
-  pic14_word inst[PIC14_INST_LEN];
+  pic14_word *inst;
   pic14_addr max_prog; /* number of program words to write */
 
   /* JEB - computed checksum from memory buffer stored here */
   pic14_word instchecksum;
 
+  /* sum of the EEPROM data bytes, as the PICkit's 'S' computes it */
+  byte eechecksum;
+
+  /* instchecksum and eechecksum are those of the memories as they
+     are: set by pic14_calc_checksum, cleared when memory is read */
+  bool summed;
+
 #define PIC14_EE_LEN 256 /* 256 bytes of EEPROM */
   /*
    * EEPROM data is available at offsets 0-127 or 255.
    * only the low 8 bits are actually stored.
    */
   pic14_addr ee_len;
-  pic14_word ee[PIC14_EE_LEN];
+  pic14_word *ee;
   pic14_addr max_ee; /* number of data bytes to write */
 
+  /*
+   * coverage maps: one bit per program word and per EEPROM byte,
+   * set for the addresses a .hex file actually defines.
+   */
+#define PIC14_MAP_LEN(n) (((n) + 7) / 8)
+#define PIC14_MAP_SET(map, a) ((map)[(a) >> 3] |= (byte)(1 << ((a) & 7)))
+#define PIC14_MAP_TEST(map, a) ((map)[(a) >> 3] & (1 << ((a) & 7)))
+  byte *inst_map;
+  byte *ee_map;
+
 } pic14_program;
 
 
@@ -101,9 +153,29 @@ typedef struct
   /* JEB - read EE data checksum stored here */
   byte eechecksum;
 
+  /* words set by a .hex file: bit i for id[i], the OSCCAL and the
+     CONFIG bits */
+#define PIC14_DEFINED_OSCCAL 0x40
+#define PIC14_DEFINED_CONFIG 0x80
+  byte defined;
+
 } pic14_config;
 
 
+/*
+ * what a .hex file load put where, in words.
+ */
+typedef struct
+{
+  unsigned int program;  /* program memory words */
+  unsigned int eeprom;   /* EEPROM data bytes */
+  unsigned int config;   /* ID, CONFIG and OSCCAL words */
+  unsigned int outside;  /* words outside of the device's memory */
+  unsigned int overlaps; /* words defined more than once */
+
+} pic14_load_stats;
+
+
 /*
  * All programmable states on a pic14.
  */
@@ -112,12 +184,43 @@ typedef struct
   pic14_program program;
   pic14_config config;
 
+  /* statistics of the last .hex file read into this state */
+  pic14_load_stats load;
+
+  /* where program and EEPROM memory come from (NULL: a default
+     arena that lives as long as the program) */
+  pic14_arena *arena;
+
 } pic14_state;
 
 
-/* initialize this state to a reasonable power-up value. */
+/* initialize this state to a reasonable power-up value.  it has no
+   program or EEPROM memory until pic14_state_size. */
 void pic14_state_init (pic14_state *p);
 
+/* give this state blank program and EEPROM memory of a device's
+   size, from its arena.  returns 0 if out of memory. */
+int pic14_state_size (pic14_state *p, pic14_addr inst_len,
+		      pic14_addr ee_len);
+
+/* find the next run of addresses set in a coverage map, starting at
+   or after *addr and below len.  runs separated by no more than gap
+   unset addresses are joined.  returns 0 if there is none left. */
+int pic14_map_extent (const byte *map, pic14_addr len, pic14_addr gap,
+		      pic14_addr *addr, pic14_addr *count);
+
+
+/*
+ * a window of program or EEPROM addresses, used to work on part of
+ * a memory only.  a NULL window pointer stands for the whole memory.
+ */
+typedef struct
+{
+  pic14_addr addr; /* first address */
+  pic14_addr len;  /* number of addresses */
+
+} pic14_range;
+
 
 /*
  * a 14-bit instruction PIC device info structure.
@@ -168,6 +271,10 @@ typedef struct
   /* device revision number */
   pic14_word rev;
 
+  /* configuration memory 0x2000-0x2007, as read when the device
+     was identified */
+  pic14_word cfg[8];
+
   /* device state */
   pic14_state state;
 
@@ -178,7 +285,29 @@ typedef struct
    value on success. */
 int pic14_hex_read (pic14_state *p, FILE *src);
 
+/* same as pic14_hex_read, for a .hex file already in memory */
+int pic14_hex_read_buffer (pic14_state *p, const char *text, size_t len);
+
+/* compute the program memory and CONFIG word checksum into
+   p->program.instchecksum */
+void pic14_calc_checksum (pic14_state *s);
+
+/* print what the last .hex file read put where */
+void pic14_print_load_stats (const pic14_load_stats *st);
+
 /* write this program to a .hex file */
 void pic14_hex_write (pic14_state *p, FILE *dest);
 
+/* write this program to a .hex file, limiting program and EEPROM
+   memory to these windows (NULL: whole memory) */
+void pic14_hex_write_range (pic14_state *p, FILE *dest,
+			    const pic14_range *prog,
+			    const pic14_range *ee);
+
+/* same as pic14_hex_write_range, leaving out runs of at least gap
+   blank program words or EEPROM bytes (gap 0: write everything) */
+void pic14_hex_write_sparse (pic14_state *p, FILE *dest,
+			     const pic14_range *prog,
+			     const pic14_range *ee, pic14_addr gap);
+
 #endif /* __PIC14_H__ */
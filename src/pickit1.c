@@ -15,8 +15,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <popt.h>
 #include "usb_pickit.h"
+#include "cache.h"
+#include "gang.h"
+#include "daemon.h"
 
 /* program's "about" description */
 static const char *description =
@@ -29,25 +33,91 @@ static const char *description =
 /* autocal.hex path */
 static const char *autocal = "autocal.hex";
 
+/* program and EEPROM address windows (--range, --ee-range) */
+static char *prog_range = NULL;
+static char *ee_range = NULL;
+
+/* directory of parsed .hex file images (--cache) */
+static char *cache_dir = NULL;
+
+/* plan file written instead of programming (--compile) */
+static char *plan_file = NULL;
+
+/* sparse .hex output (--sparse, --gap) */
+static int sparse = 0;
+static int sparse_gap = 8;
+
+/* set by SIGINT during --loop */
+static volatile sig_atomic_t interrupted = 0;
+
+/*
+ * what the operations of one command line share while working on a
+ * chip: the PICKit, the chip found in its socket and its memory once
+ * read, and the last .hex file parsed for it.
+ */
+typedef struct
+{
+  usb_pickit *d;
+
+  pic14_device dev; /* the chip, once found */
+  pic14_arena arena; /* dev's memories */
+  bool found;
+  bool fresh; /* dev.cfg is what the chip holds: nothing written since */
+  bool read; /* dev.state holds all of the chip's memory */
+
+  pic14_device file; /* .hex file filename, parsed for the chip */
+  pic14_arena file_arena; /* file's memories */
+  const char *filename; /* NULL if none */
+
+  jmp_buf *on_error; /* where transfer errors jump, NULL: exit */
+
+} pickit1_session;
+
+/* one operation of the command line */
+typedef struct
+{
+  int mode;
+  const char *filename;
+  int bg;
+
+} pickit1_op;
+
+/* most operations on one command line */
+#define PICKIT1_MAX_OPS 16
+
 /* declaration of program's mode functions */
-static int pickit1_program (usb_pickit *d, const char *filename, bool programall);
-static int pickit1_extract (usb_pickit *d, const char *filename);
-static int pickit1_verify (usb_pickit *d, const char *filename);
-static int pickit1_blank_check (usb_pickit *d);
-static int pickit1_erase (usb_pickit *d);
-static int pickit1_memory_map (usb_pickit *d);
-static int pickit1_config (usb_pickit *d);
+static int pickit1_program (pickit1_session *s, const char *filename,
+			    bool programall, bool update);
+static int pickit1_extract (pickit1_session *s, const char *filename);
+static int pickit1_verify (pickit1_session *s, const char *filename,
+			   bool defined, int max_errors);
+static int pickit1_blank_check (pickit1_session *s);
+static int pickit1_erase (pickit1_session *s);
+static int pickit1_memory_map (pickit1_session *s);
+static int pickit1_config (pickit1_session *s);
 static int pickit1_reset (usb_pickit *d);
 static int pickit1_off (usb_pickit *d);
 static int pickit1_on (usb_pickit *d);
 static int pickit1_oscoff (usb_pickit *d);
 static int pickit1_oscon (usb_pickit *d);
-static int pickit1_bandgap (usb_pickit *d, int bg);
-static int pickit1_osccal_regen (usb_pickit **d);
+static int pickit1_bandgap (pickit1_session *s, int bg);
+static int pickit1_osccal_regen (pickit1_session *s);
+static int pickit1_replay (pickit1_session *s, const char *filename);
+static int pickit1_plan (const char *filename);
+static void pickit1_print_stats (usb_pickit *d);
+static int pickit1_gang (int mode, const char *filename, bool defined,
+			 int max_errors);
+static int pickit1_daemon (const char *path);
+static int pickit1_loop (pickit1_session *s, const pickit1_op *ops,
+			 int nops, bool defined, int max_errors, int poll);
+static int pickit1_run (pickit1_session *s, const pickit1_op *ops,
+			int nops, bool defined, int max_errors);
+static int pickit1_command (int argc, const char *argv[],
+			    usb_pickit **held);
 
 #ifdef DEBUG
-static int pickit1_test_write_program (usb_pickit *d);
-static int pickit1_test_write_eeprom (usb_pickit *d);
+static int pickit1_test_write_program (pickit1_session *s);
+static int pickit1_test_write_eeprom (pickit1_session *s);
 #endif
 
 /* list of programer's options */
@@ -67,6 +137,12 @@ enum programer_mode {
   OPT_BANDGAP,     /* pickit1_bandgap */
   OPT_OSCCALREGEN, /* pickit1_osccal_regen */
   OPT_PROGRAMALL,  /* pickit1_program */
+  OPT_UPDATE,      /* pickit1_program */
+  OPT_REPLAY,      /* pickit1_replay */
+  OPT_PLAN,        /* pickit1_plan */
+  OPT_SESSION,     /* pickit_record_report */
+  OPT_JOBS,        /* gang_jobs */
+  OPT_DAEMON,      /* pickit1_daemon */
 
 #ifdef DEBUG
   OPT_TEST_WR_PROGRAM, /* pickit1_test_write_program */
@@ -75,180 +151,643 @@ enum programer_mode {
 };
 
 /*
- * write a .hex file to the PIC.
+ * parse a "<first>-<last>" address range (or a single address) for
+ * a memory of len addresses.  returns 0 on errors.
  */
 static int
-pickit1_program (usb_pickit *d, const char *filename, bool programall)
+pickit1_parse_range (const char *arg, pic14_addr len, const char *what,
+		     pic14_range *r)
 {
-  pic14_device dev;
+  unsigned long first, last;
+  char *end;
+
+  first = strtoul (arg, &end, 0);
+  last = first;
+
+  if (*end == '-')
+    last = strtoul (end + 1, &end, 0);
+
+  if (*end != '\0' || first > last || last >= len)
+    {
+      fprintf (stderr, "Error: bad %s range '%s', device has "
+	       "addresses 0x0000-0x%04x\n", what, arg, len - 1);
+      return 0;
+    }
+
+  r->addr = first;
+  r->len = last - first + 1;
+
+  return 1;
+}
+
+/*
+ * get the program and EEPROM windows given on the command line for
+ * this device.  a window that was not given is NULL, for the whole
+ * memory.  returns 0 on errors.
+ */
+static int
+pickit1_windows (pic14_state *s, const pic14_range **prog,
+		 const pic14_range **ee)
+{
+  static pic14_range pr, er;
+
+  *prog = NULL;
+  *ee = NULL;
+
+  if (prog_range)
+    {
+      if (!pickit1_parse_range (prog_range, s->program.inst_len,
+				"program", &pr))
+	return 0;
+
+      *prog = &pr;
+    }
+
+  if (ee_range)
+    {
+      if (!pickit1_parse_range (ee_range, s->program.ee_len,
+				"EEPROM", &er))
+	return 0;
+
+      *ee = &er;
+    }
+
+  return 1;
+}
+
+/*
+ * read a .hex file for this device, through the cache directory if
+ * one was given.
+ */
+static int
+pickit1_hex_read (pic14_device *dev, FILE *fp)
+{
+  if (cache_dir)
+    return cache_hex_read (&dev->state, fp, cache_dir,
+			   dev->dinfo->device_id);
+
+  return pic14_hex_read (&dev->state, fp);
+}
+
+/*
+ * start a session on the PICKit d.
+ */
+static void
+pickit1_session_init (pickit1_session *s, usb_pickit *d)
+{
+  s->d = d;
+  s->found = s->fresh = s->read = 0;
+  pic14_arena_init (&s->arena);
+  pic14_arena_init (&s->file_arena);
+  s->filename = NULL;
+  s->on_error = NULL;
+}
+
+/*
+ * forget the chip: another one may be in the socket.  the .hex file
+ * is kept for it.
+ */
+static void
+pickit1_session_chip (pickit1_session *s)
+{
+  s->found = s->fresh = s->read = 0;
+  pic14_arena_free (&s->arena);
+  pic14_arena_init (&s->arena);
+}
+
+static void
+pickit1_session_free (pickit1_session *s)
+{
+  pic14_arena_free (&s->arena);
+  pic14_arena_free (&s->file_arena);
+}
+
+/*
+ * the chip has been written to: what was read of it is out of date.
+ */
+static void
+pickit1_session_written (pickit1_session *s)
+{
+  s->fresh = s->read = 0;
+}
+
+/*
+ * find the chip on the PICKit board, once per session.  with fresh
+ * set, it is looked for again if it has been written to since, for
+ * its IDs and CONFIG word as they are now.
+ */
+static pic14_device *
+pickit1_device (pickit1_session *s, bool fresh)
+{
+  if (s->found && (s->fresh || !fresh))
+    return &s->dev;
+
+  pickit1_session_chip (s);
+
+  /* zero out the state first, so anything that isn't read
+     won't be uninitialized */
+  pic14_state_init (&s->dev.state);
+  s->dev.state.arena = &s->arena;
+
+  if (!usb_pickit_get_device (s->d, &s->dev))
+    return NULL;
+
+  s->found = s->fresh = 1;
+  return &s->dev;
+}
+
+/*
+ * read all of the chip's memory, once per session unless it is
+ * written to.
+ */
+static pic14_state *
+pickit1_device_read (pickit1_session *s)
+{
+  pic14_device *dev = pickit1_device (s, 1);
+
+  if (!dev)
+    return NULL;
+
+  if (!s->read)
+    {
+      usb_pickit_read_device (s->d, dev, PICKIT_READ_ALL, NULL, NULL);
+      usb_pickit_calc_checksum (&dev->state);
+      s->read = 1;
+    }
+
+  return &dev->state;
+}
+
+/*
+ * the .hex file filename, parsed for the chip on the PICKit board.
+ * a file already parsed for this type of chip is not parsed again.
+ */
+static pic14_state *
+pickit1_image (pickit1_session *s, const char *filename)
+{
+  pic14_device *dev = pickit1_device (s, 0);
+  pic14_device *file = &s->file;
   FILE *fp;
 
+  if (!dev)
+    return NULL;
+
+  if (s->filename && !strcmp (s->filename, filename)
+      && file->dinfo == dev->dinfo)
+    return &file->state;
+
+  s->filename = NULL;
+  pic14_arena_free (&s->file_arena);
+  pic14_arena_init (&s->file_arena);
+
   fp = fopen (filename, "r");
   if (!fp)
     {
       perror ("Could not open program file");
-      return 0;
+      return NULL;
     }
 
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  /* sized and set up for the chip, as usb_pickit_get_device does */
+  *file = *dev;
+  pic14_state_init (&file->state);
+  file->state.arena = &s->file_arena;
 
-  /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  if (!pic14_state_size (&file->state, dev->dinfo->inst_len,
+			 dev->dinfo->ee_len))
     {
       fclose (fp);
-      return 0;
+      return NULL;
     }
 
-  /* read the .hex file containing the program to burn to the PIC */
-  if (!pic14_hex_read (&dev.state, fp))
+  file->state.config.save_osccal = dev->dinfo->save_osccal;
+  file->state.config.configmask = dev->dinfo->configmask;
+
+  /* read the .hex file containing the program for the PIC */
+  if (!pickit1_hex_read (file, fp))
     {
       fclose (fp);
-      return 0;
+      return NULL;
     }
 
   fclose (fp);
 
+  s->filename = filename;
+  return &file->state;
+}
+
+/*
+ * write a .hex file to the PIC.  with update set, the PIC is left
+ * alone if it already holds the .hex file.
+ */
+static int
+pickit1_program (pickit1_session *s, const char *filename,
+		 bool programall, bool update)
+{
+  pic14_state *image, state;
+  FILE *fp;
+  int rc;
+
+  image = pickit1_image (s, filename);
+  if (!image)
+    return 0;
+
+  if (plan_file)
+    {
+      /* record what programming would send, don't send it */
+      fp = fopen (plan_file, "wb");
+      if (!fp)
+	{
+	  perror ("Could not create plan file");
+	  return 0;
+	}
+
+      rc = usb_pickit_compile (s->d, &s->file, fp);
+
+      if (fclose (fp) != 0 && rc)
+	{
+	  perror ("Could not write plan file");
+	  rc = 0;
+	}
+
+      return rc;
+    }
+
+  /* a copy: writing changes the state's configuration, and the .hex
+     file may be used again by the next operation */
+  state = *image;
+
+  if (update && usb_pickit_is_programmed (s->d, &state))
+    {
+      printf ("device already holds %s, not programmed.\n", filename);
+      return 1;
+    }
+
   /* write the program and exit */
+  pickit1_session_written (s);
+
   if (programall)
-    usb_pickit_write (d, &dev.state, 0);
+    usb_pickit_write (s->d, &state, 0);
   else
-    usb_pickit_write (d, &dev.state, 1);
+    usb_pickit_write (s->d, &state, 1);
 
   return 1;
 }
 
 /*
- * extract program and EEPROM data memory from a PIC
- * and write them in an output file.
+ * program the chip from a plan file made with --compile.
  */
 static int
-pickit1_extract (usb_pickit *d, const char *filename)
+pickit1_replay (pickit1_session *s, const char *filename)
 {
-  pic14_device dev;
+  pic14_device *dev;
   FILE *fp;
+  int rc;
 
-  fp = fopen (filename, "w+");
+  fp = fopen (filename, "rb");
   if (!fp)
     {
-      perror ("Could not create output file");
+      perror ("Could not open plan file");
       return 0;
     }
 
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
-
-  /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  /* the plan must be for the device on the PICKit board */
+  dev = pickit1_device (s, 0);
+  if (!dev)
     {
       fclose (fp);
       return 0;
     }
 
-  /* read memory from the device */
-  usb_pickit_read (d, &dev.state);
-
-  /* JEB added calc checksum function */
-  usb_pickit_calc_checksum (&dev.state);
+  pickit1_session_written (s);
 
-  /* write the program to output file */
-  pic14_hex_write (&dev.state, fp);
+  rc = usb_pickit_replay (s->d, dev, fp);
   fclose (fp);
 
-  return 1;
+  return rc;
 }
 
 /*
- * verify the contents of the device with a .hex file. (JEB)
+ * print the packets of a plan file.
  */
 static int
-pickit1_verify (usb_pickit *d, const char *filename)
+pickit1_plan (const char *filename)
 {
-  pic14_device dev, dfile;
   FILE *fp;
+  int rc;
 
-  fp = fopen (filename, "r");
+  fp = fopen (filename, "rb");
   if (!fp)
     {
-      perror ("Could not open program file");
+      perror ("Could not open plan file");
       return 0;
     }
 
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dfile.state);
+  rc = usb_pickit_print_plan (fp);
+  fclose (fp);
 
-  /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dfile))
+  return rc;
+}
+
+
+/*
+ * print the USB traffic of this session.
+ */
+static void
+pickit1_print_stats (usb_pickit *d)
+{
+  pickit_stats st;
+
+  usb_pickit_stats (d, &st);
+
+  printf ("USB traffic: %lu OUT transfers of %lu packets, "
+	  "%lu IN transfers of %lu bytes\n",
+	  st.writes, st.packets, st.reads, st.bytes);
+
+  if (st.usec)
+    printf ("time on the transfers: %lu.%03lu ms\n",
+	    st.usec / 1000, st.usec % 1000);
+}
+
+/*
+ * program, update or verify on all PICKits at once.  programming
+ * also verifies.
+ */
+static int
+pickit1_gang (int mode, const char *filename, bool defined, int max_errors)
+{
+  unsigned int what;
+
+  switch (mode)
     {
-      fclose (fp);
+    case OPT_PROGRAM:
+      what = GANG_PROGRAM | GANG_VERIFY;
+      break;
+
+    case OPT_UPDATE:
+      what = GANG_UPDATE | GANG_VERIFY;
+      break;
+
+    case OPT_VERIFY:
+      what = GANG_VERIFY;
+      break;
+
+    default:
+      fprintf (stderr, "Error: --gang works with --program, --update "
+	       "and --verify only\n");
+      return 0;
+    }
+
+  if (defined || prog_range || ee_range || plan_file)
+    {
+      fprintf (stderr, "Error: --gang does not take --defined, --range, "
+	       "--ee-range or --compile\n");
       return 0;
     }
 
-  /* read the .hex file containing the program to verify */
-  if (!pic14_hex_read (&dfile.state, fp))
+  return gang_run (filename, cache_dir, what, max_errors);
+}
+
+/*
+ * run a command line sent by pickit1c.
+ */
+static int
+pickit1_serve (int argc, const char *argv[], void *data)
+{
+  return pickit1_command (argc, argv, (usb_pickit **)data);
+}
+
+/*
+ * keep the PICKit open and run the command lines sent to the socket
+ * path, until stopped.
+ */
+static int
+pickit1_daemon (const char *path)
+{
+  usb_pickit *d;
+  int fd, ok;
+
+  /* the socket first: another daemon may hold the PICKit */
+  fd = daemon_listen (path);
+  if (fd < 0)
+    return 0;
+
+  if (NULL == (d = usb_pickit_open ()))
+    {
+      daemon_close (fd, path);
+      return 0;
+    }
+
+  ok = daemon_serve (fd, path, pickit1_serve, &d);
+
+  /* NULL if a request lost it */
+  if (d)
+    usb_pickit_close (d);
+
+  return ok;
+}
+
+static void
+pickit1_interrupt (int sig)
+{
+  interrupted = 1;
+}
+
+/*
+ * production line: poll the device ID every poll ms until a chip is
+ * in the socket, run the operations on it, wait for it to be taken
+ * out, and again for the next chip, until interrupted.  a chip counts
+ * as inserted once the same ID was read twice in a row.
+ */
+static int
+pickit1_loop (pickit1_session *s, const pickit1_op *ops, int nops,
+	      bool defined, int max_errors, int poll)
+{
+  const pic14_device_info *dinfo;
+  usb_pickit_socket w = { 0, 0, 0 };
+  int i, chips = 0, failed = 0;
+
+  for (i = 0; i < nops; ++i)
+    switch (ops[i].mode)
+      {
+      case OPT_PROGRAM:
+      case OPT_UPDATE:
+      case OPT_VERIFY:
+      case OPT_REPLAY:
+      case OPT_BLANKCHECK:
+      case OPT_ERASE:
+	break;
+
+      default:
+	fprintf (stderr, "Error: --loop works with --program, --update, "
+		 "--verify, --replay, --blankcheck and --erase only\n");
+	return 0;
+      }
+
+  if (poll <= 0)
+    {
+      fprintf (stderr, "Error: --poll must be at least 1 ms\n");
+      return 0;
+    }
+
+  interrupted = 0;
+  signal (SIGINT, pickit1_interrupt);
+
+  printf ("waiting for a chip, Ctrl-C to stop\n");
+  fflush (stdout);
+
+  while (!interrupted)
+    {
+      switch (usb_pickit_watch (s->d, &w))
+	{
+	case PICKIT_CHIP_OUT:
+	  printf ("chip taken out, waiting for the next one\n");
+	  fflush (stdout);
+	  break;
+
+	case PICKIT_CHIP_IN:
+	  dinfo = pic14_get_device (w.id & 0xffe0);
+	  chips++;
+
+	  printf ("\nchip %d: PIC%s rev %d\n", chips, dinfo->device_name,
+		  w.id & 0x1f);
+
+	  /* a new chip; the .hex files parsed are kept */
+	  pickit1_session_chip (s);
+
+	  if (!pickit1_run (s, ops, nops, defined, max_errors))
+	    {
+	      failed++;
+	      printf ("chip %d FAILED\n", chips);
+	    }
+	  else
+	    printf ("chip %d done\n", chips);
+
+	  fflush (stdout);
+	  break;
+	}
+
+      pickit_sleep ((unsigned long)poll * 1000);
+    }
+
+  signal (SIGINT, SIG_DFL);
+
+  printf ("\n%d chips, %d failed\n", chips, failed);
+
+  return failed == 0;
+}
+
+/*
+ * extract program and EEPROM data memory from a PIC
+ * and write them in an output file.
+ */
+static int
+pickit1_extract (pickit1_session *s, const char *filename)
+{
+  const pic14_range *prog, *ee;
+  pic14_device *dev;
+  FILE *fp;
+
+  if (sparse && sparse_gap < 1)
+    {
+      fprintf (stderr, "Error: --gap must be at least 1\n");
+      return 0;
+    }
+
+  fp = fopen (filename, "w+");
+  if (!fp)
+    {
+      perror ("Could not create output file");
+      return 0;
+    }
+
+  /* find the device on the PICKit board */
+  dev = pickit1_device (s, 1);
+  if (!dev || !pickit1_windows (&dev->state, &prog, &ee))
     {
       fclose (fp);
       return 0;
     }
 
+  /* read memory from the device, unless it was read already */
+  if (prog || ee)
+    {
+      usb_pickit_read_device (s->d, dev, PICKIT_READ_ALL, prog, ee);
+
+      /* JEB added calc checksum function */
+      usb_pickit_calc_checksum (&dev->state);
+      s->read = 0;
+    }
+  else
+    pickit1_device_read (s);
+
+  /* write the program to output file, leaving out blank runs of at
+     least sparse_gap words if asked to */
+  pic14_hex_write_sparse (&dev->state, fp, prog, ee,
+			  sparse ? sparse_gap : 0);
   fclose (fp);
 
-  usb_pickit_calc_checksum (&dfile.state);
+  return 1;
+}
+
+/*
+ * verify the contents of the device with a .hex file. (JEB)
+ * the device is compared while it is read, and reading stops after
+ * max_errors mismatches.  with defined, only the addresses the .hex
+ * file sets are read and compared.
+ */
+static int
+pickit1_verify (pickit1_session *s, const char *filename, bool defined,
+		int max_errors)
+{
+  const pic14_range *prog, *ee;
+  pic14_state *image;
 
-  dev.state.config.configmask = dfile.state.config.configmask;
-  dev.state.program.inst_len = dfile.state.program.inst_len;
-  dev.state.program.ee_len = dfile.state.program.ee_len;
+  /* find the device on the PICKit board, read the .hex file
+     containing the program to verify */
+  image = pickit1_image (s, filename);
+  if (!image || !pickit1_windows (image, &prog, &ee))
+    return 0;
 
-  usb_pickit_read (d, &dev.state);
-  usb_pickit_calc_checksum (&dev.state);
-  return usb_pickit_verify (&dfile.state, &dev.state);
+  /* a chip read already is compared in memory */
+  if (s->read && !prog && !ee && !defined)
+    return usb_pickit_verify (image, &s->dev.state);
 
-  return 1;
+  return usb_pickit_verify_device (s->d, image, prog, ee, defined,
+				   max_errors);
 }
 
 /*
  * check to make sure chip is blank. (JEB)
+ * stops reading at the first location which is not blank.
  */
 static int
-pickit1_blank_check (usb_pickit *d)
+pickit1_blank_check (pickit1_session *s)
 {
-  pic14_device dev;
-
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  pic14_device *dev;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 0);
+  if (!dev)
     return 0;
 
-  usb_pickit_read (d, &dev.state);
-  usb_pickit_calc_checksum (&dev.state);
-  return usb_pickit_blank_check (&dev.state);
-
-  return 1;
+  return usb_pickit_blank_check_device (s->d, &dev->state);
 }
 
 /*
  * erase the PIC, program and data memory.
  */
 static int
-pickit1_erase (usb_pickit *d)
+pickit1_erase (pickit1_session *s)
 {
-  pic14_device dev;
-
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  pic14_device *dev;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 0);
+  if (!dev)
     return 0;
 
-  usb_pickit_erase (d, &dev.state);
+  pickit1_session_written (s);
+  usb_pickit_erase (s->d, &dev->state);
 
   return 1;
 }
@@ -257,20 +796,26 @@ pickit1_erase (usb_pickit *d)
  * print current program and data memory from the PIC.
  */
 static int
-pickit1_memory_map (usb_pickit *d)
+pickit1_memory_map (pickit1_session *s)
 {
-  pic14_device dev;
-
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  const pic14_range *prog, *ee;
+  pic14_device *dev;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 1);
+  if (!dev || !pickit1_windows (&dev->state, &prog, &ee))
     return 0;
 
-  usb_pickit_read (d, &dev.state);
-  usb_pickit_memory_map (d, &dev.state);
+  /* read memory from the device, unless it was read already */
+  if (prog || ee)
+    {
+      usb_pickit_read_device (s->d, dev, PICKIT_READ_ALL, prog, ee);
+      s->read = 0;
+    }
+  else
+    pickit1_device_read (s);
+
+  usb_pickit_memory_map_range (s->d, &dev->state, prog, ee);
 
   return 1;
 }
@@ -279,19 +824,16 @@ pickit1_memory_map (usb_pickit *d)
  * print PIC's current configuration words.
  */
 static int
-pickit1_config (usb_pickit *d)
+pickit1_config (pickit1_session *s)
 {
-  pic14_device dev;
-
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  pic14_device *dev;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 1);
+  if (!dev)
     return 0;
 
-  usb_pickit_print_config (d, &dev.state);
+  usb_pickit_print_config (s->d, dev);
 
   return 1;
 }
@@ -357,19 +899,17 @@ pickit1_oscon (usb_pickit *d)
  * NOTE: for 629, 675, 630 and 676 devices only.
  */
 static int
-pickit1_bandgap (usb_pickit *d, int bg)
+pickit1_bandgap (pickit1_session *s, int bg)
 {
-  pic14_device dev;
-
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
+  pic14_device *dev;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 0);
+  if (!dev)
     return 0;
 
-  usb_pickit_set_bandgap (d, &dev.state, bg);
+  pickit1_session_written (s);
+  usb_pickit_set_bandgap (s->d, &dev->state, bg);
 
   return 1;
 }
@@ -378,10 +918,12 @@ pickit1_bandgap (usb_pickit *d, int bg)
  * regenerate OSCCAL from the 2.5 kHz oscillator.
  */
 static int
-pickit1_osccal_regen (usb_pickit **d)
+pickit1_osccal_regen (pickit1_session *s)
 {
   pic14_device dev;
+  pic14_arena arena;
   FILE *fp;
+  int rc = 0;
 
   fp = fopen (autocal, "r");
   if (!fp)
@@ -391,23 +933,22 @@ pickit1_osccal_regen (usb_pickit **d)
     }
 
   /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
+     won't be uninitialized.  its memories only live here */
+  pic14_arena_init (&arena);
   pic14_state_init (&dev.state);
+  dev.state.arena = &arena;
 
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (*d, &dev))
-    return 0;
-
-  if (dev.state.config.save_osccal)
+  if (!usb_pickit_get_device (s->d, &dev))
+    ;
+  else if (!dev.state.config.save_osccal)
+    fprintf (stderr, "Only PIC 629, 675, 630, 676 support "
+	     "OscCalRegeneration.\n");
+  else if (pickit1_hex_read (&dev, fp))
     {
-      if (!pic14_hex_read (&dev.state, fp))
-	{
-	  fclose (fp);
-	  return 0;
-	}
-
-      fclose (fp);
-      usb_pickit_write (*d, &dev.state, 1);
+      /* the session's chip is not what it was */
+      pickit1_session_chip (s);
+      usb_pickit_write (s->d, &dev.state, 1);
 
       /*
        * JEB - For some reason, have to close the USB device and reopen
@@ -417,18 +958,21 @@ pickit1_osccal_regen (usb_pickit **d)
        * info twice because of the multiple open calls.
        */
 
-      usb_pickit_close (*d);
-      *d = usb_pickit_open ();
-      usb_pickit_osccal_regen (*d, &dev.state);
-    }
-  else
-    {
-      fprintf (stderr, "Only PIC 629, 675, 630, 676 support "
-	       "OscCalRegeneration.\n");
-      return 0;
+      usb_pickit_close (s->d);
+      s->d = usb_pickit_open ();
+
+      if (s->d)
+	{
+	  usb_pickit_catch (s->d, s->on_error);
+	  usb_pickit_osccal_regen (s->d, &dev.state);
+	  rc = 1;
+	}
     }
 
-  return 1;
+  fclose (fp);
+  pic14_arena_free (&arena);
+
+  return rc;
 }
 
 #ifdef DEBUG
@@ -437,28 +981,28 @@ pickit1_osccal_regen (usb_pickit **d)
  * !!!TEST
  */
 static int
-pickit1_test_write_program (usb_pickit *d)
+pickit1_test_write_program (pickit1_session *s)
 {
-  pic14_device dev;
+  pic14_device *dev;
   int i, j;
 
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
-
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 0);
+  if (!dev)
     return 0;
 
+  pickit1_session_written (s);
+
   printf ("== Program memory writing test ==\n");
 
-  dev.state.program.max_prog = dev.state.program.inst_len;
+  dev->state.program.max_prog = dev->state.program.inst_len;
+  dev->state.program.summed = 0;
 
-  for (i = 0; i < dev.state.program.inst_len; i += 8)
+  for (i = 0; i < dev->state.program.inst_len; i += 8)
     for (j = 0; j < 8; ++j)
-      dev.state.program.inst[i + j] = i + j;
+      dev->state.program.inst[i + j] = i + j;
 
-  usb_pickit_write (d, &dev.state, 1);
+  usb_pickit_write (s->d, &dev->state, 1);
 
   return 1;
 }
@@ -470,52 +1014,248 @@ pickit1_test_write_program (usb_pickit *d)
  * !!!TEST
  */
 static int
-pickit1_test_write_eeprom (usb_pickit *d)
+pickit1_test_write_eeprom (pickit1_session *s)
 {
-  pic14_device dev;
+  pic14_device *dev;
   int i, j;
 
-  /* zero out the state first, so anything that isn't read
-     won't be uninitialized */
-  pic14_state_init (&dev.state);
-
   /* find the device on the PICKit board */
-  if (!usb_pickit_get_device (d, &dev))
+  dev = pickit1_device (s, 0);
+  if (!dev)
     return 0;
 
+  pickit1_session_written (s);
+
   printf ("== EEPROM Data memory writing test ==\n");
 
-  dev.state.program.max_ee = dev.state.program.ee_len;
+  dev->state.program.max_ee = dev->state.program.ee_len;
+  dev->state.program.summed = 0;
 
-  for (i = 0; i < dev.state.program.ee_len; i += 8)
+  for (i = 0; i < dev->state.program.ee_len; i += 8)
     for (j = 0; j < 8; ++j)
-      dev.state.program.ee[i + j] = i + j;
+      dev->state.program.ee[i + j] = i + j;
 
-  usb_pickit_write (d, &dev.state, 1);
+  usb_pickit_write (s->d, &dev->state, 1);
 
   return 1;
 }
 #endif /* DEBUG */
 
 /*
- * programer's main entry point.  enter the proper mode given
- * parameters passed to the program.
+ * run one operation of the programer in the session.
  */
-int
-main (int argc, const char *argv[])
+static int
+pickit1_mode (pickit1_session *s, const pickit1_op *op, bool defined,
+	      int max_errors)
 {
-  usb_pickit *d = NULL;
+  const char *filename = op->filename;
+  int rc = 0;
+
+  switch (op->mode)
+    {
+    case OPT_PROGRAM:
+      rc = pickit1_program (s, filename, 0, 0);
+      break;
+
+    case OPT_EXTRACT:
+      rc = pickit1_extract (s, filename);
+      break;
+
+    case OPT_VERIFY:
+      rc = pickit1_verify (s, filename, defined, max_errors);
+      break;
+
+    case OPT_BLANKCHECK:
+      rc = pickit1_blank_check (s);
+      break;
+
+    case OPT_ERASE:
+      rc = pickit1_erase (s);
+      break;
+
+    case OPT_MEMORYMAP:
+      rc = pickit1_memory_map (s);
+      break;
+
+    case OPT_CONFIG:
+      rc = pickit1_config (s);
+      break;
+
+    case OPT_RESET:
+      rc = pickit1_reset (s->d);
+      break;
+
+    case OPT_OFF:
+      rc = pickit1_off (s->d);
+      break;
+
+    case OPT_ON:
+      rc = pickit1_on (s->d);
+      break;
+
+    case OPT_OSCOFF:
+      rc = pickit1_oscoff (s->d);
+      break;
+
+    case OPT_OSCON:
+      rc = pickit1_oscon (s->d);
+      break;
+
+    case OPT_BANDGAP:
+      rc = pickit1_bandgap (s, op->bg);
+      break;
+
+    case OPT_OSCCALREGEN:
+      rc = pickit1_osccal_regen (s);
+      break;
+
+    case OPT_PROGRAMALL:
+      rc = pickit1_program (s, filename, 1, 0);
+      break;
+
+    case OPT_UPDATE:
+      rc = pickit1_program (s, filename, 0, 1);
+      break;
+
+    case OPT_REPLAY:
+      rc = pickit1_replay (s, filename);
+      break;
+
+#ifdef DEBUG
+    case OPT_TEST_WR_PROGRAM:
+      rc = pickit1_test_write_program (s);
+      break;
+
+    case OPT_TEST_WR_EEPROM:
+      rc = pickit1_test_write_eeprom (s);
+      break;
+#endif /* DEBUG */
+    }
+
+  return rc;
+}
+
+/*
+ * run the operations one after another, on the same chip, until one
+ * of them fails.
+ */
+static int
+pickit1_run (pickit1_session *s, const pickit1_op *ops, int nops,
+	     bool defined, int max_errors)
+{
+  int i;
+
+  for (i = 0; i < nops; ++i)
+    if (!pickit1_mode (s, &ops[i], defined, max_errors))
+      return 0;
+
+  return 1;
+}
+
+/*
+ * run the operations with transfer errors failing them rather than
+ * ending the program, for the daemon: it outlives a request which
+ * went wrong.
+ */
+static int
+pickit1_run_caught (pickit1_session *s, const pickit1_op *ops, int nops,
+		    bool defined, int max_errors)
+{
+  jmp_buf env;
+  int rc;
+
+  if (setjmp (env))
+    {
+      /* the PICKit may be closed already, by --osccalregen */
+      if (s->d)
+	usb_pickit_catch (s->d, NULL);
+      s->on_error = NULL;
+      return 0;
+    }
+
+  s->on_error = &env;
+  usb_pickit_catch (s->d, &env);
+
+  rc = pickit1_run (s, ops, nops, defined, max_errors);
+
+  if (s->d)
+    usb_pickit_catch (s->d, NULL);
+  s->on_error = NULL;
+
+  return rc;
+}
+
+/*
+ * enter the proper mode given a command line.  held is the PICKit
+ * the daemon keeps open, NULL to open one for this command only.
+ */
+static int
+pickit1_command (int argc, const char *argv[], usb_pickit **held)
+{
+  usb_pickit *d = held ? *held : NULL;
+  pickit1_op ops[PICKIT1_MAX_OPS];
   char *filename = NULL;
-  int bg, rc;
+  int bg = 0, rc, opt, nops = 0;
+  int max_errors = 1, defined = 0, stats = 0, gang = 0;
+  int loop = 0, poll = 500, timeout = 60;
+  bool many = 0, alone = 0, bad_bg = 0;
 
   /* programer's command line options */
   struct poptOption options[] = {
     { "program", 'p', POPT_ARG_STRING, &filename, OPT_PROGRAM,
       "Writes .hex file to chip", "<file>" },
+    { "update", 'u', POPT_ARG_STRING, &filename, OPT_UPDATE,
+      "Writes .hex file to chip unless chip already holds it", "<file>" },
     { "extract", 'x', POPT_ARG_STRING, &filename, OPT_EXTRACT,
       "Read from chip into .hex file", "<file>" },
     { "verify", 'v', POPT_ARG_STRING, &filename, OPT_VERIFY,
       "Read from chip and compare with .hex file", "<file>" },
+    { "maxerrors", '\0', POPT_ARG_INT, &max_errors, 0,
+      "Stop verify after <int> mismatches, 0: report all (default 1)",
+      "<int>" },
+    { "defined", '\0', POPT_ARG_NONE, &defined, 0,
+      "Only verify the addresses the .hex file defines", NULL },
+    { "cache", '\0', POPT_ARG_STRING, &cache_dir, 0,
+      "Keep parsed .hex files in directory <dir> for later runs", "<dir>" },
+    { "compile", '\0', POPT_ARG_STRING, &plan_file, 0,
+      "With --program, save the USB packets to <file> instead of "
+      "sending them", "<file>" },
+    { "replay", '\0', POPT_ARG_STRING, &filename, OPT_REPLAY,
+      "Program chip with the packets saved by --compile", "<file>" },
+    { "plan", '\0', POPT_ARG_STRING, &filename, OPT_PLAN,
+      "Print the packets saved by --compile", "<file>" },
+    { "session", '\0', POPT_ARG_STRING, &filename, OPT_SESSION,
+      "Print a session recorded with PICKIT_RECORD", "<file>" },
+    { "sparse", '\0', POPT_ARG_NONE, &sparse, 0,
+      "Leave blank memory out of extracted .hex files", NULL },
+    { "gap", '\0', POPT_ARG_INT, &sparse_gap, 0,
+      "Only leave out blank runs of <int> words or more (default 8)",
+      "<int>" },
+    { "range", '\0', POPT_ARG_STRING, &prog_range, 0,
+      "Only extract, verify or show program memory <first>-<last>",
+      "<addr>" },
+    { "ee-range", '\0', POPT_ARG_STRING, &ee_range, 0,
+      "Only extract, verify or show EEPROM <first>-<last>", "<addr>" },
+    { "stats", '\0', POPT_ARG_NONE, &stats, 0,
+      "Print the USB traffic when done", NULL },
+    { "gang", '\0', POPT_ARG_NONE, &gang, 0,
+      "Program, update or verify on every PICkit attached at once",
+      NULL },
+    { "loop", '\0', POPT_ARG_NONE, &loop, 0,
+      "Wait for each chip put in the socket and program, update or "
+      "verify it, until Ctrl-C", NULL },
+    { "poll", '\0', POPT_ARG_INT, &poll, 0,
+      "With --loop or --jobs, look for a chip every <int> ms "
+      "(default 500)", "<int>" },
+    { "jobs", '\0', POPT_ARG_STRING, &filename, OPT_JOBS,
+      "Program the chips listed in job file <file> on every PICkit "
+      "attached", "<file>" },
+    { "timeout", '\0', POPT_ARG_INT, &timeout, 0,
+      "With --jobs, stop a PICkit which gets no new chip within <int> s "
+      "(default 60)", "<int>" },
+    { "daemon", '\0', POPT_ARG_STRING, &filename, OPT_DAEMON,
+      "Keep the PICkit open and run the commands pickit1c sends to "
+      "socket <file>", "<file>" },
     { "blankcheck", 'b', POPT_ARG_NONE, NULL, OPT_BLANKCHECK,
       "Read chip, check all locations for 1 or blank", NULL },
     { "erase", 'e', POPT_ARG_NONE, NULL, OPT_ERASE,
@@ -551,91 +1291,143 @@ main (int argc, const char *argv[])
   };
 
   /* context for parsing command-line options */
-  poptContext poptcon = poptGetContext (NULL, argc, argv, options, 0);
+  poptContext poptcon;
+  int i;
+
+  /* settings left by the daemon's previous command */
+  prog_range = ee_range = cache_dir = plan_file = NULL;
+  sparse = 0;
+  sparse_gap = 8;
+
+  poptcon = poptGetContext (NULL, argc, argv, options, 0);
   poptSetOtherOptionHelp (poptcon, "[OPTION]");
 
-  /* peek first option, ignore others */
-  rc = poptGetNextOpt (poptcon);
-  if (rc > 0)
+  /* popt ends the program after printing help: not the daemon's */
+  for (i = 1; held && i < argc; ++i)
+    if (!strcmp (argv[i], "--help") || !strcmp (argv[i], "-?")
+	|| !strcmp (argv[i], "--usage"))
+      {
+	poptPrintHelp (poptcon, stdout, 0);
+	poptFreeContext (poptcon);
+	return 0;
+      }
+
+  /* gather the mode options as operations, in the order given, each
+     with its own file.  settings such as --maxerrors apply to all of
+     them, wherever they are */
+  while ((opt = poptGetNextOpt (poptcon)) > 0)
     {
-      /* open PICKit device */
-      if (NULL == (d = usb_pickit_open ()))
-	exit (EXIT_FAILURE);
-
-      switch (rc)
+      if (nops == PICKIT1_MAX_OPS)
 	{
-	case OPT_PROGRAM:
-	  rc = pickit1_program (d, filename, 0);
-	  break;
-
-	case OPT_EXTRACT:
-	  rc = pickit1_extract (d, filename);
-	  break;
-
-	case OPT_VERIFY:
-	  rc = pickit1_verify (d, filename);
-	  break;
-
-	case OPT_BLANKCHECK:
-	  rc = pickit1_blank_check (d);
-	  break;
-
-	case OPT_ERASE:
-	  rc = pickit1_erase (d);
-	  break;
-
-	case OPT_MEMORYMAP:
-	  rc = pickit1_memory_map (d);
-	  break;
-
-	case OPT_CONFIG:
-	  rc = pickit1_config (d);
-	  break;
-
-	case OPT_RESET:
-	  rc = pickit1_reset (d);
-	  break;
-
-	case OPT_OFF:
-	  rc = pickit1_off (d);
-	  break;
+	  many = 1;
+	  continue;
+	}
 
-	case OPT_ON:
-	  rc = pickit1_on (d);
-	  break;
+      ops[nops].mode = opt;
+      ops[nops].filename = filename;
+      ops[nops].bg = bg;
 
-	case OPT_OSCOFF:
-	  rc = pickit1_oscoff (d);
-	  break;
+      if (opt == OPT_BANDGAP && (bg < 0 || bg > 3))
+	bad_bg = 1;
 
-	case OPT_OSCON:
-	  rc = pickit1_oscon (d);
-	  break;
+      if (opt == OPT_DAEMON || opt == OPT_JOBS || opt == OPT_PLAN
+	  || opt == OPT_SESSION)
+	alone = 1;
 
-	case OPT_BANDGAP:
-	  rc = pickit1_bandgap (d, bg);
-	  break;
+      nops++;
+    }
 
-	case OPT_OSCCALREGEN:
-	  rc = pickit1_osccal_regen (&d);
-	  break;
+  rc = opt < -1 ? opt : nops ? ops[0].mode : -1;
+  filename = nops ? (char *)ops[0].filename : NULL;
 
-	case OPT_PROGRAMALL:
-	  rc = pickit1_program (d, filename, 1);
-	  break;
+  if (rc > 0 && many)
+    {
+      fprintf (stderr, "Error: more than %d operations\n",
+	       PICKIT1_MAX_OPS);
+      rc = 0;
+    }
+  else if (rc > 0 && bad_bg)
+    {
+      fprintf (stderr, "Error: bandgap must be between 0 and 3\n");
+      rc = 0;
+    }
+  else if (rc > 0 && nops > 1 && (alone || gang))
+    {
+      fprintf (stderr, "Error: --daemon, --jobs, --plan, --session and "
+	       "--gang take no other operation\n");
+      rc = 0;
+    }
+  else if (held && (rc == OPT_DAEMON || rc == OPT_JOBS
+		     || (rc > 0 && (gang || loop))))
+    {
+      /* the other PICKits are left to other processes, and a loop
+	 would keep the daemon from its other clients */
+      fprintf (stderr, "Error: the daemon does not run --daemon, --gang, "
+	       "--jobs or --loop\n");
+      rc = 0;
+    }
+  else if (rc == OPT_DAEMON)
+    {
+      /* this PICKit, for pickit1c */
+      rc = pickit1_daemon (filename);
+    }
+  else if (rc == OPT_JOBS)
+    {
+      /* jobs are dealt out to every attached PICKit */
+      rc = gang_jobs (filename, cache_dir, max_errors, poll, timeout);
+    }
+  else if (rc > 0 && gang)
+    {
+      /* every attached PICKit, one thread each */
+      rc = pickit1_gang (rc, filename, defined, max_errors);
+    }
+  else if (rc == OPT_PLAN)
+    {
+      /* a plan file is printed without a PICKit */
+      rc = pickit1_plan (filename);
+    }
+  else if (rc == OPT_SESSION)
+    {
+      /* so is a session file */
+      rc = pickit_record_report (filename, 1);
+    }
+  else if (rc > 0)
+    {
+      pickit1_session s;
 
-#ifdef DEBUG
-	case OPT_TEST_WR_PROGRAM:
-	  rc = pickit1_test_write_program (d);
-	  break;
+      /* open PICKit device, unless the daemon holds it.  the daemon
+	 opens it again if it was lost */
+      if (!d && NULL == (d = usb_pickit_open ()))
+	{
+	  if (!held)
+	    exit (EXIT_FAILURE);
 
-	case OPT_TEST_WR_EEPROM:
-	  rc = pickit1_test_write_eeprom (d);
-	  break;
-#endif /* DEBUG */
+	  rc = 0;
+	}
+      else
+	{
+	  /* one session for all the operations */
+	  pickit1_session_init (&s, d);
+
+	  if (loop)
+	    rc = pickit1_loop (&s, ops, nops, defined, max_errors, poll);
+	  else if (held)
+	    rc = pickit1_run_caught (&s, ops, nops, defined, max_errors);
+	  else
+	    rc = pickit1_run (&s, ops, nops, defined, max_errors);
+
+	  /* --osccalregen reopens the PICKit, and may lose it */
+	  d = s.d;
+	  pickit1_session_free (&s);
+
+	  if (stats && d)
+	    pickit1_print_stats (d);
+
+	  if (held)
+	    *held = d;
+	  else if (d)
+	    usb_pickit_close (d);
 	}
-
-      usb_pickit_close (d);
     }
   else
     {
@@ -654,3 +1446,12 @@ main (int argc, const char *argv[])
 
   return rc - 1;
 }
+
+/*
+ * programer's main entry point.
+ */
+int
+main (int argc, const char *argv[])
+{
+  return pickit1_command (argc, argv, NULL);
+}
@@ -0,0 +1,32 @@
+/*
+ * pickit1c.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Client of the programmer daemon (pickit1 --daemon).  takes the same
+ * options as pickit1 and has the daemon run them, so that the PICkit
+ * need not be looked for, claimed and set up for each command.
+ */
+
+#include <stdlib.h>
+#include "daemon.h"
+
+int
+main (int argc, const char *argv[])
+{
+  const char *path = getenv ("PICKIT_SOCKET");
+  int result;
+
+  if (!path || !*path)
+    path = DAEMON_SOCKET;
+
+  if (!daemon_call (path, argc, argv, &result))
+    return EXIT_FAILURE;
+
+  return result;
+}
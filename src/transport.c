@@ -0,0 +1,109 @@
+/*
+ * transport.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * List of transports.
+ */
+
+#if defined (__unix__) || defined (__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#define TRANSPORT_MONOTONIC
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "transport.h"
+
+/* known transports, the default one first */
+static const pickit_transport *const transports[] = {
+  &pickit_libusb,
+  &pickit_emulator,
+  &pickit_replayer,
+  NULL
+};
+
+/*
+ * get a transport by name.
+ */
+const pickit_transport *
+pickit_transport_find (const char *name)
+{
+  int i;
+
+  if (!name || !*name)
+    return transports[0];
+
+  for (i = 0; transports[i]; ++i)
+    if (!strcmp (transports[i]->name, name))
+      return transports[i];
+
+  fprintf (stderr, "Error: unknown transport '%s', known ones are:", name);
+  for (i = 0; transports[i]; ++i)
+    fprintf (stderr, " %s", transports[i]->name);
+  fprintf (stderr, "\n");
+
+  return NULL;
+}
+
+/*
+ * the file of a unit.
+ */
+char *
+pickit_unit_path (const char *path, int unit)
+{
+  char *p = (char *)malloc (strlen (path) + 16);
+
+  if (!p)
+    return NULL;
+
+  if (unit)
+    sprintf (p, "%s.%d", path, unit);
+  else
+    strcpy (p, path);
+
+  return p;
+}
+
+/*
+ * microseconds on a monotonic clock.
+ */
+unsigned long
+pickit_clock ()
+{
+#ifdef TRANSPORT_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#else
+  return (unsigned long)((double)clock () * 1000000.0 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * wait usec microseconds.
+ */
+void
+pickit_sleep (unsigned long usec)
+{
+#ifdef TRANSPORT_MONOTONIC
+  struct timespec ts;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  nanosleep (&ts, NULL);
+#else
+  unsigned long t0 = pickit_clock ();
+
+  while (pickit_clock () - t0 < usec)
+    ;
+#endif
+}
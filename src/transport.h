@@ -0,0 +1,109 @@
+/*
+ * transport.h
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Transports carry the PICkit's 8-byte packets.  libusb is one of
+ * them; usb_pickit.c only deals with a transport, through its table
+ * of functions.
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include "common.h"
+
+/*
+ * traffic on a transport since it was opened.
+ */
+typedef struct
+{
+  unsigned long writes;  /* OUT transfers */
+  unsigned long packets; /* OUT packets */
+  unsigned long reads;   /* IN transfers */
+  unsigned long bytes;   /* IN bytes */
+
+  /* time spent on the transfers, in microseconds.  0 if the
+     transport does not know */
+  unsigned long usec;
+
+} pickit_stats;
+
+/*
+ * a transport's functions.  a transport's open returns a handle
+ * passed to the other ones, or NULL on errors (which it reports).
+ * PICkits are numbered from 0 in the order the transport finds
+ * them; each one may be opened once, and driven from its own
+ * thread.
+ */
+typedef struct
+{
+  /* name selecting the transport (PICKIT_TRANSPORT) */
+  const char *name;
+
+  /* number of PICkits attached */
+  int (*count) (void);
+
+  void *(*open) (int unit);
+
+  /* write len bytes, a whole number of packets, in one transfer.
+     returns the number of bytes written, < 0 on errors */
+  int (*write) (void *h, const byte *src, int len);
+
+  /* read len bytes.  returns the number of bytes read, < 0 on
+     errors */
+  int (*read) (void *h, byte *dest, int len);
+
+  /* returns 0 on errors */
+  int (*close) (void *h);
+
+  /* describe the last error */
+  const char *(*error) (void *h);
+
+  /* fill in what the transport knows beyond the counts kept by
+     usb_pickit.c (NULL: nothing) */
+  void (*stats) (void *h, pickit_stats *st);
+
+} pickit_transport;
+
+/* the libusb transport */
+extern const pickit_transport pickit_libusb;
+
+/* a PICkit emulated in the program (transport_emu.c) */
+extern const pickit_transport pickit_emulator;
+
+/* replay of the session file named by PICKIT_REPLAY
+   (transport_record.c) */
+extern const pickit_transport pickit_replayer;
+
+/* get a transport recording the transfers of t, with their timing,
+   to the session file path */
+const pickit_transport *pickit_record (const pickit_transport *t,
+				       const char *path);
+
+/* print the time a recorded session spent in each phase (erase,
+   writes, reads, ...), and with verbose each transfer.  returns 0
+   on errors */
+int pickit_record_report (const char *path, bool verbose);
+
+/* get a transport by name (NULL: the default one).  returns NULL
+   after listing the transports if there is no such transport */
+const pickit_transport *pickit_transport_find (const char *name);
+
+/* the file of this unit for a transport keeping one file per PICkit:
+   path for unit 0, path.<unit> for the others.  allocated with
+   malloc, NULL if out of memory */
+char *pickit_unit_path (const char *path, int unit);
+
+/* microseconds on a monotonic clock, for timing transfers */
+unsigned long pickit_clock ();
+
+/* wait usec microseconds, such as between polls of a PICkit */
+void pickit_sleep (unsigned long usec);
+
+#endif /* __TRANSPORT_H__ */
@@ -0,0 +1,632 @@
+/*
+ * transport_emu.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * A PICkit 1 with firmware 2.0.2 and a PIC on its board, emulated
+ * in the program, for working without the hardware.  the commands
+ * are run as doc/PROTOCOL.txt describes them, and the time they
+ * would take on the PICkit is added up:
+ *
+ *   - each OUT and IN packet takes one 1 ms USB frame
+ *   - 'P' takes 4 ms, 'W' 4 ms, 'D' 8 ms, 'E', 'e' and 'S' 10 ms
+ *
+ * the emulated PIC is chosen with PICKIT_EMU_DEVICE, a device name
+ * from devices.c ("12F675" if not set) or a device ID word with
+ * revision.  a comma separated list gives the PIC of each unit.  if
+ * PICKIT_EMU_IMAGE names a file, the PIC's memories are loaded from
+ * it when opened and saved to it when closed.  PICKIT_EMU_UNITS sets
+ * the number of PICkits (1 if not set); the image and socket files
+ * of unit n > 0 get ".n" appended.  if PICKIT_EMU_SOCKET names a
+ * file, the PIC is in the socket only while that file exists
+ * (checked when entering programming mode): an empty socket reads
+ * 0x3fff and ignores writes.
+ *
+ * commands the firmware would not run as the programmer expects
+ * (outside programming mode, split across packets, writes over
+ * words not erased, ...) are reported and counted: closing the
+ * emulator fails if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pic14.h"
+#include "transport.h"
+
+/* PICkit always uses 8-byte packets */
+#define EMU_PACKET_LEN 8
+
+#define EMU_PROG_LEN 0x2000 /* largest program memory */
+#define EMU_EE_LEN 256      /* largest EEPROM */
+#define EMU_REPLY_LEN 1024  /* replies to one transfer */
+
+/* time of the firmware's operations, in microseconds */
+#define EMU_FRAME 1000 /* a USB frame, for each packet */
+#define EMU_ENTER 4000 /* 'P' */
+#define EMU_WRITE 4000 /* 'W' */
+#define EMU_DATA  8000 /* 'D' */
+#define EMU_ERASE 10000 /* 'E', 'e' and 'S' */
+
+/*
+ * an emulated PICkit and PIC.
+ */
+typedef struct
+{
+  const pic14_device_info *dinfo;
+  char *image; /* allocated, NULL if none */
+  char *socket; /* file present while the PIC is, NULL if none */
+  bool present;
+
+  /* the PIC's memories */
+  pic14_word prog[EMU_PROG_LEN];
+  pic14_word cfg[8]; /* 0x2000-0x2007 */
+  byte ee[EMU_EE_LEN];
+  pic14_addr inst_len; /* program words, OSCCAL included */
+  pic14_addr ee_len;
+
+  /* the firmware's state */
+  bool progmode;
+  byte vdd;
+  pic14_addr pc;
+
+  byte reply[EMU_REPLY_LEN]; /* not read yet */
+  int replied;
+
+  unsigned long usec;
+  unsigned long errors;
+  char error[80];
+
+} emu;
+
+/*
+ * report a command the firmware would not run as expected.
+ */
+static void
+emu_fail (emu *e, const char *what, int c)
+{
+  fprintf (stderr, "emulator: '%c' %s (pc 0x%04x)\n", c, what, e->pc);
+  e->errors++;
+}
+
+/*
+ * queue a 8-byte reply.
+ */
+static void
+emu_reply (emu *e, const byte *b, int c)
+{
+  if (e->replied + EMU_PACKET_LEN > EMU_REPLY_LEN)
+    {
+      emu_fail (e, "replies overflow the firmware", c);
+      return;
+    }
+
+  memcpy (e->reply + e->replied, b, EMU_PACKET_LEN);
+  e->replied += EMU_PACKET_LEN;
+}
+
+/*
+ * program memory or configuration word at this address.
+ */
+static pic14_word
+emu_read_word (emu *e, pic14_addr addr)
+{
+  if (!e->present)
+    return 0x3fff;
+
+  if (addr >= 0x2000)
+    return addr < 0x2008 ? e->cfg[addr - 0x2000] : 0x3fff;
+
+  return e->prog[addr % e->inst_len];
+}
+
+/*
+ * write the word at pc.  flash bits only go from 1 to 0, so a word
+ * must have been erased first; configuration words are and-ed.  the
+ * device ID can't be written.
+ */
+static void
+emu_write_word (emu *e, pic14_word w)
+{
+  w &= 0x3fff;
+
+  if (!e->present)
+    ;
+  else if (e->pc >= 0x2000)
+    {
+      if (e->pc < 0x2008 && e->pc != 0x2006)
+	e->cfg[e->pc - 0x2000] &= w;
+    }
+  else
+    {
+      pic14_word *p = &e->prog[e->pc % e->inst_len];
+
+      if (*p != 0x3fff)
+	emu_fail (e, "over a word not erased", 'W');
+
+      *p = w;
+    }
+
+  e->pc++;
+}
+
+/*
+ * is the PIC in the socket?
+ */
+static bool
+emu_present (emu *e)
+{
+  FILE *fp;
+
+  if (!e->socket)
+    return 1;
+
+  fp = fopen (e->socket, "r");
+  if (!fp)
+    return 0;
+
+  fclose (fp);
+  return 1;
+}
+
+/*
+ * run the commands of one OUT packet.
+ */
+static void
+emu_packet (emu *e, const byte *p)
+{
+  byte b[EMU_PACKET_LEN];
+  pic14_addr n, i;
+  int k = 0, c, len;
+  unsigned int sum, eesum;
+
+  e->usec += EMU_FRAME;
+
+  /* the firmware does not take packets before its replies were
+     read */
+  if (e->replied)
+    emu_fail (e, "sent before replies were read", p[0]);
+
+  while (k < EMU_PACKET_LEN)
+    {
+      c = p[k++];
+
+      /* argument bytes */
+      switch (c)
+	{
+	case 'V':
+	case 'D':
+	  len = 1;
+	  break;
+	case 'I':
+	case 'W':
+	  len = 2;
+	  break;
+	case 'S':
+	  len = 4;
+	  break;
+	default:
+	  len = 0;
+	}
+
+      if (k + len > EMU_PACKET_LEN)
+	{
+	  emu_fail (e, "split across packets", c);
+	  return;
+	}
+
+      if (!e->progmode && c && strchr ("CEeIWDRr", c))
+	emu_fail (e, "outside programming mode", c);
+
+      switch (c)
+	{
+	case 'P':
+	  e->present = emu_present (e);
+	  e->progmode = 1;
+	  e->vdd = 1;
+	  e->pc = 0;
+	  e->usec += EMU_ENTER;
+	  break;
+
+	case 'p':
+	  e->progmode = 0;
+	  e->vdd = 0;
+	  break;
+
+	case 'V':
+	  e->vdd = p[k];
+	  break;
+
+	case 'v':
+	  memset (b, 0, EMU_PACKET_LEN);
+	  b[0] = 2;
+	  b[1] = 0;
+	  b[2] = 2;
+	  emu_reply (e, b, c);
+	  break;
+
+	case 'C':
+	  e->pc = 0x2000;
+	  break;
+
+	case 'E':
+	  /* in configuration memory, the IDs and CONFIG word go too */
+	  for (i = 0; e->present && i < EMU_PROG_LEN; ++i)
+	    e->prog[i] = 0x3fff;
+
+	  if (e->present && e->pc >= 0x2000)
+	    for (i = 0; i < 8; ++i)
+	      if (i != 6)
+		e->cfg[i] = 0x3fff;
+
+	  e->usec += EMU_ERASE;
+	  break;
+
+	case 'e':
+	  if (e->present)
+	    memset (e->ee, 0xff, EMU_EE_LEN);
+	  e->usec += EMU_ERASE;
+	  break;
+
+	case 'I':
+	  e->pc += p[k] | (p[k + 1] << 8);
+	  break;
+
+	case 'W':
+	  emu_write_word (e, p[k] | (p[k + 1] << 8));
+	  e->usec += EMU_WRITE;
+	  break;
+
+	case 'D':
+	  if (e->present && e->ee_len)
+	    e->ee[e->pc % e->ee_len] = p[k];
+	  e->pc++;
+	  e->usec += EMU_DATA;
+	  break;
+
+	case 'R':
+	  for (i = 0; i < 4; ++i)
+	    {
+	      pic14_word w = emu_read_word (e, e->pc + i);
+
+	      b[2 * i] = (byte)(w & 0xff);
+	      b[2 * i + 1] = (byte)(w >> 8);
+	    }
+
+	  e->pc += 4;
+	  emu_reply (e, b, c);
+	  break;
+
+	case 'r':
+	  for (i = 0; i < 8; ++i)
+	    b[i] = e->present && e->ee_len
+	      ? e->ee[(e->pc + i) % e->ee_len] : 0xff;
+
+	  e->pc += 8;
+	  emu_reply (e, b, c);
+	  break;
+
+	case 'S':
+	  /* sums over program memory 0..n-1 and EEPROM; leaves the
+	     device in programming mode */
+	  n = p[k] | (p[k + 1] << 8);
+	  sum = 0;
+	  for (i = 0; i < n; ++i)
+	    sum += e->prog[i % e->inst_len];
+
+	  n = p[k + 2] | (p[k + 3] << 8);
+	  eesum = 0;
+	  for (i = 0; i < n && e->ee_len; ++i)
+	    eesum += e->ee[i % e->ee_len];
+
+	  memset (b, 'Z', EMU_PACKET_LEN);
+	  b[0] = (byte)(sum & 0xff);
+	  b[1] = (byte)((sum >> 8) & 0xff);
+	  b[2] = (byte)(eesum & 0xff);
+
+	  e->progmode = 1;
+	  e->usec += EMU_ERASE;
+	  emu_reply (e, b, c);
+	  break;
+
+	case 'Z':
+	  break;
+
+	default:
+	  emu_fail (e, "is not a command", c);
+	}
+
+      k += len;
+    }
+}
+
+/*
+ * load the PIC's memories from the image file, if there is one.
+ */
+static void
+emu_load (emu *e)
+{
+  FILE *fp;
+
+  if (!e->image)
+    return;
+
+  fp = fopen (e->image, "rb");
+  if (!fp)
+    return;
+
+  if (fread (e->prog, sizeof (pic14_word), EMU_PROG_LEN, fp) != EMU_PROG_LEN
+      || fread (e->cfg, sizeof (pic14_word), 8, fp) != 8
+      || fread (e->ee, 1, EMU_EE_LEN, fp) != EMU_EE_LEN)
+    fprintf (stderr, "emulator: %s is not a whole image\n",
+	     e->image);
+
+  fclose (fp);
+}
+
+/*
+ * save the PIC's memories to the image file, if there is one.
+ */
+static int
+emu_save (emu *e)
+{
+  FILE *fp;
+  int ok;
+
+  if (!e->image)
+    return 1;
+
+  fp = fopen (e->image, "wb");
+  if (!fp)
+    {
+      perror ("emulator: could not write image");
+      return 0;
+    }
+
+  ok = fwrite (e->prog, sizeof (pic14_word), EMU_PROG_LEN, fp)
+    == EMU_PROG_LEN
+    && fwrite (e->cfg, sizeof (pic14_word), 8, fp) == 8
+    && fwrite (e->ee, 1, EMU_EE_LEN, fp) == EMU_EE_LEN;
+
+  if (fclose (fp) != 0 || !ok)
+    {
+      fprintf (stderr, "emulator: could not write image %s\n", e->image);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * find the device of this unit, by name or device ID word, in a
+ * comma separated list.  the last device of the list is used for
+ * the units after it.
+ */
+static const pic14_device_info *
+emu_device (const char *list, int unit, pic14_word *id)
+{
+  const pic14_device_info *d;
+  char name[32], *end;
+  unsigned long w;
+  size_t len;
+
+  if (!list || !*list)
+    list = "12F675";
+
+  while (unit-- > 0 && strchr (list, ','))
+    list = strchr (list, ',') + 1;
+
+  len = strcspn (list, ",");
+  if (len >= sizeof (name))
+    len = sizeof (name) - 1;
+
+  memcpy (name, list, len);
+  name[len] = '\0';
+
+  for (d = __devices; d->device_id != 0xffff; ++d)
+    if (!strcmp (d->device_name, name))
+      {
+	*id = d->device_id;
+	return d;
+      }
+
+  w = strtoul (name, &end, 0);
+  if (*name && *end == '\0' && (d = pic14_get_device (w & 0xffe0)) != NULL)
+    {
+      *id = (pic14_word)w;
+      return d;
+    }
+
+  fprintf (stderr, "emulator: unknown device '%s'\n", name);
+  return NULL;
+}
+
+/*
+ * the number of emulated PICkits.
+ */
+static int
+emu_count ()
+{
+  const char *units = getenv ("PICKIT_EMU_UNITS");
+
+  return units ? atoi (units) : 1;
+}
+
+/*
+ * open an emulated PICkit, with a blank or saved PIC.
+ */
+static void *
+emu_open (int unit)
+{
+  const char *image = getenv ("PICKIT_EMU_IMAGE");
+  const char *socket = getenv ("PICKIT_EMU_SOCKET");
+  const pic14_device_info *dinfo;
+  pic14_word id;
+  emu *e;
+  int i;
+
+  if (unit >= emu_count ())
+    {
+      fprintf (stderr, "Could not find emulated PICkit %d\n", unit);
+      return NULL;
+    }
+
+  dinfo = emu_device (getenv ("PICKIT_EMU_DEVICE"), unit, &id);
+  if (!dinfo)
+    return NULL;
+
+  e = (emu *)calloc (1, sizeof (emu));
+  if (!e)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      return NULL;
+    }
+
+  e->dinfo = dinfo;
+
+  if (image && *image)
+    e->image = pickit_unit_path (image, unit);
+  if (socket && *socket)
+    e->socket = pickit_unit_path (socket, unit);
+
+  if ((image && *image && !e->image) || (socket && *socket && !e->socket))
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      free (e->image);
+      free (e->socket);
+      free (e);
+      return NULL;
+    }
+
+  e->present = emu_present (e);
+
+  /* OSCCAL devices hold 0x3ff words and the OSCCAL word */
+  e->inst_len = (dinfo->inst_len + 0x3ff) & ~0x3ff;
+  e->ee_len = dinfo->ee_len;
+
+  /* a blank PIC, with its factory OSCCAL and bandgap bits */
+  for (i = 0; i < EMU_PROG_LEN; ++i)
+    e->prog[i] = 0x3fff;
+  for (i = 0; i < 8; ++i)
+    e->cfg[i] = 0x3fff;
+  memset (e->ee, 0xff, EMU_EE_LEN);
+
+  if (dinfo->save_osccal)
+    {
+      e->prog[0x3ff] = 0x3480; /* retlw 0x80 */
+      e->cfg[7] &= ~0x1000;
+    }
+
+  emu_load (e);
+  e->cfg[6] = id;
+
+  if (unit)
+    printf ("emulating PICkit %d with a PIC%s\n", unit, dinfo->device_name);
+  else
+    printf ("emulating a PICkit 1 with a PIC%s\n", dinfo->device_name);
+
+  return e;
+}
+
+/*
+ * run the packets of an OUT transfer.
+ */
+static int
+emu_write (void *h, const byte *src, int len)
+{
+  emu *e = (emu *)h;
+  int i;
+
+  if (len <= 0 || len % EMU_PACKET_LEN)
+    {
+      sprintf (e->error, "transfer of %d bytes is not whole packets", len);
+      return -1;
+    }
+
+  for (i = 0; i < len; i += EMU_PACKET_LEN)
+    emu_packet (e, src + i);
+
+  return len;
+}
+
+/*
+ * read replies.
+ */
+static int
+emu_read (void *h, byte *dest, int len)
+{
+  emu *e = (emu *)h;
+
+  if (len > e->replied)
+    {
+      sprintf (e->error, "%d bytes asked, %d replied (timeout)",
+	       len, e->replied);
+      return -1;
+    }
+
+  memcpy (dest, e->reply, len);
+  memmove (e->reply, e->reply + len, e->replied - len);
+  e->replied -= len;
+  e->usec += (len + EMU_PACKET_LEN - 1) / EMU_PACKET_LEN * EMU_FRAME;
+
+  return len;
+}
+
+/*
+ * save the PIC and check the session.
+ */
+static int
+emu_close (void *h)
+{
+  emu *e = (emu *)h;
+  int ok = emu_save (e);
+
+  if (e->replied)
+    {
+      fprintf (stderr, "emulator: %d bytes of replies never read\n",
+	       e->replied);
+      e->errors++;
+    }
+
+  if (e->errors)
+    {
+      fprintf (stderr, "emulator: %lu protocol errors\n", e->errors);
+      ok = 0;
+    }
+
+  free (e->image);
+  free (e->socket);
+  free (e);
+  return ok;
+}
+
+static const char *
+emu_error (void *h)
+{
+  return ((emu *)h)->error;
+}
+
+/*
+ * the modeled time.
+ */
+static void
+emu_stats (void *h, pickit_stats *st)
+{
+  st->usec = ((emu *)h)->usec;
+}
+
+const pickit_transport pickit_emulator = {
+  "emulator",
+  emu_count,
+  emu_open,
+  emu_write,
+  emu_read,
+  emu_close,
+  emu_error,
+  emu_stats
+};
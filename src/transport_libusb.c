@@ -0,0 +1,318 @@
+/*
+ * transport_libusb.c
+ *
+ * libusb transport to the Microchip PICkit 1 FLASH Starter Kit.
+ *
+ * Orion Sky Lawlor, olawlor@acm.org, 2003/8/3
+ * Mark Rages, markrages@gmail.com, 2005/4/1
+ * Jeff Boly, jboly@teammojo.org, 2005/12/31
+ * David Henry, tfc_duke@club-internet.fr, 2007/1/27
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <usb.h>
+#include "transport.h"
+
+/* PICkit USB values */
+const static int pickit_vendorID = 0x04d8; /* Microchip, Inc */
+const static int pickit_productID = 0x0032; /* PICkit 1 FLASH starter kit */
+const static int pickit_configuration = 2; /* 1: HID; 2: vendor specific */
+const static int pickit_interface = 0;
+const static int pickit_endpoint_out = 1; /* endpoint 1 address for OUT */
+const static int pickit_endpoint_in = 0x81; /* endpoint 0x81 address for IN */
+const static int pickit_timeout = 1000; /* timeout in ms */
+
+
+/*
+ * Stupidity:
+ *  In an excellent example of sacrificing backward compatability
+ * for conformance to some proported "standard", the latest Linux
+ * kernel USB drivers (uhci-alternate in 2.4.24+, and uhci in 2.6.x)
+ * no longer support low speed bulk mode transfers -- they give
+ * "invalid argument", errno = -22, on any attempt to do a low speed
+ * bulk write.  Thus, we need interrupt mode transfers, which are
+ * only available via the CVS version of libusb.
+ *
+ * (Thanks to Steven Michalske for diagnosing the true problem here.)
+ */
+
+/*
+ * JEB - Note here, for the Mac, there is no interrupt mode, so need to set this
+ * define to zero to get it to compile.  I use Mac OS X.
+ */
+#ifndef HAVE_LIBUSB_INTERRUPT_MODE
+#define HAVE_LIBUSB_INTERRUPT_MODE 1
+#endif
+
+#if HAVE_LIBUSB_INTERRUPT_MODE
+/* latest libusb: interrupt mode, works with all kernels */
+#define PICKIT_USB(direction) usb_interrupt_##direction
+#else
+/* older libusb: bulk mode, will only work with older kernels */
+#define PICKIT_USB(direction) usb_bulk_##direction
+#endif
+
+
+/*
+ * set the configuration of the opened PICKit and claim its
+ * interface.
+ */
+static int
+libusb0_claim (usb_dev_handle *h)
+{
+  /* set the configuration for USB PICKit */
+  if (usb_set_configuration (h, pickit_configuration) < 0)
+    {
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return 0;
+    }
+
+  /* this is our device, claim it */
+  if (usb_claim_interface (h, pickit_interface) < 0)
+    {
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * look for PICKits on the USB busses, once.
+ */
+static void
+libusb0_scan ()
+{
+  static int scanned = 0;
+
+  if (scanned)
+    return;
+
+  scanned = 1;
+
+  /* announce what we are looking for */
+  printf ("Locating USB Microchip(tm) PICkit(tm) "
+	  "(vendor 0x%04x/product 0x%04x)\n",
+	  pickit_vendorID, pickit_productID);
+
+  /* libusb setup code stolen from John Fremlin's cool "usb-robot" */
+  usb_init ();
+#ifdef DEBUG
+  usb_set_debug (4);
+#endif
+  usb_find_busses ();
+  usb_find_devices ();
+}
+
+/*
+ * get the USB device of this PICKit unit, NULL if there are fewer
+ * PICKits.  with unit -1, count them instead.
+ */
+static struct usb_device *
+libusb0_find (int unit, int *count)
+{
+  struct usb_device *device;
+  struct usb_bus *bus;
+  int n = 0;
+
+  libusb0_scan ();
+
+  /* look through each bus */
+  for (bus = usb_busses; bus != NULL; bus = bus->next)
+    {
+      struct usb_device *usb_devices = bus->devices;
+
+      /* look through each device of this bus */
+      for (device = usb_devices; device != NULL;
+	   device = device->next)
+	{
+	  /* check if vendor ID and product ID correspond */
+	  if (device->descriptor.idVendor == pickit_vendorID &&
+	      device->descriptor.idProduct == pickit_productID)
+	    {
+	      if (n++ == unit)
+		return device;
+	    }
+	}
+    }
+
+  if (count)
+    *count = n;
+
+  return NULL;
+}
+
+/*
+ * count the PICKits attached.
+ */
+static int
+libusb0_count ()
+{
+  int n;
+
+  libusb0_find (-1, &n);
+  return n;
+}
+
+/*
+ * open a PICKit, the first one found being unit 0.
+ */
+static void *
+libusb0_open (int unit)
+{
+  struct usb_device *device;
+  int retval;
+  char dname[32] = {0};
+  usb_dev_handle *h;
+#if 0
+#ifndef _WIN32
+  /* ensure user have root privileges for executing this program */
+  if (geteuid () != 0)
+    {
+      fprintf (stderr, "this program must be run as root, "
+	       "or made setuid root\n");
+      return NULL;
+    }
+#endif /* _WIN32 */
+#endif
+
+  device = libusb0_find (unit, NULL);
+  if (!device)
+    {
+      /* we looked through each device of each bus and didn't
+	 find PICKit */
+      if (unit == 0)
+	fprintf (stderr, "Could not find USB PICKit device!\n"
+		 "you might try lsusb to see if it's actually there.\n");
+      else
+	fprintf (stderr, "Could not find USB PICKit device %d\n", unit);
+
+      return NULL;
+    }
+
+  /* we found PICKit! */
+  printf ("found USB PICkit as device '%s' on USB bus %s\n",
+	  device->filename, device->bus->dirname);
+
+  /* open the device */
+  h = usb_open (device);
+  if (!h)
+    {
+      fprintf (stderr, "Error: failed to open USB device\n");
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return NULL;
+    }
+
+#ifdef __linux__
+  /* look if a driver doesn't already claim this interface */
+  retval = usb_get_driver_np (h, 0, dname, 31);
+  if (!retval)
+    {
+      /* detach it so we can use the interface via libusb */
+      usb_detach_kernel_driver_np (h, 0);
+
+      /* reopen the device */
+      usb_close (h);
+      h = usb_open (device);
+      if (!h)
+	{
+	  fprintf (stderr, "Error: failed to open USB device\n");
+	  fprintf (stderr, "%s\n", usb_strerror ());
+	  return NULL;
+	}
+    }
+#endif /* __linux__ */
+
+  if (!libusb0_claim (h))
+    {
+      usb_close (h);
+      return NULL;
+    }
+
+  return h;
+}
+
+/*
+ * write packets to the OUT endpoint.
+ */
+static int
+libusb0_write (void *h, const byte *src, int len)
+{
+  return PICKIT_USB(write)((usb_dev_handle *)h, pickit_endpoint_out,
+			   (char *)src, len, pickit_timeout);
+}
+
+/*
+ * read from the IN endpoint.
+ */
+static int
+libusb0_read (void *h, byte *dest, int len)
+{
+  return PICKIT_USB(read)((usb_dev_handle *)h, pickit_endpoint_in,
+			  (char *)dest, len, pickit_timeout);
+}
+
+/*
+ * release and close the PICKit.
+ */
+static int
+libusb0_close (void *handle)
+{
+  usb_dev_handle *h = (usb_dev_handle *)handle;
+
+  /* release claimed interface */
+  if (usb_release_interface (h, pickit_interface) < 0)
+    {
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return 0;
+    }
+
+#ifdef _WIN32
+  /* !!!HACK: for some reasons, the usb device need to be reset before
+     closing.  Otherwise, you'll have to deal with weird behaviours... */
+  if (usb_reset (h) < 0)
+    {
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return 0;
+    }
+
+  return 1;
+#endif /* _WIN32 */
+
+  /* close usb device */
+  if (usb_close (h) < 0)
+    {
+      fprintf (stderr, "%s\n", usb_strerror ());
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * describe the last libusb error.
+ */
+static const char *
+libusb0_error (void *h)
+{
+  return usb_strerror ();
+}
+
+const pickit_transport pickit_libusb = {
+  "libusb",
+  libusb0_count,
+  libusb0_open,
+  libusb0_write,
+  libusb0_read,
+  libusb0_close,
+  libusb0_error,
+  NULL
+};
@@ -0,0 +1,728 @@
+/*
+ * transport_record.c
+ *
+ * This code is licenced under the MIT license.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code.
+ *
+ * Recording of USB sessions, and their replay.
+ *
+ * a session file starts with "PK1S", followed by one entry per
+ * transfer, integers little-endian:
+ *
+ *   direction    1 byte, '>' OUT or '<' IN
+ *   len          2 bytes, bytes asked for
+ *   result       2 bytes, signed: bytes moved, < 0 on errors
+ *   start        4 bytes, microseconds since the transport was opened
+ *   time         4 bytes, microseconds the transfer took
+ *   payload      len bytes for OUT, result bytes (if > 0) for IN
+ *
+ * times are measured on a monotonic clock, unless the recorded
+ * transport knows how long its transfers take (the emulator): its
+ * time is recorded then.
+ *
+ * each PICkit has its own session file: unit n > 0 gets ".n"
+ * appended to the file name.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+
+#define RECORD_HEAD_LEN 13 /* bytes of an entry before the payload */
+#define RECORD_MAX_LEN 0x7fff /* largest transfer */
+
+/*
+ * one transfer of a session.
+ */
+typedef struct
+{
+  byte dir;
+  unsigned int len;
+  int result;
+  unsigned long start;
+  unsigned long usec;
+
+} record_entry;
+
+/*
+ * a transport being recorded.
+ */
+typedef struct
+{
+  const pickit_transport *t;
+  void *h;
+
+  FILE *fp;
+  unsigned long t0;
+  unsigned long usec; /* time spent in transfers */
+
+  /* the time of the last transfer's end, when the transport knows
+     its time */
+  bool modeled;
+  unsigned long now;
+
+} recorder;
+
+/*
+ * a session being replayed.
+ */
+typedef struct
+{
+  FILE *fp;
+  char *path;
+  unsigned long n; /* entries replayed */
+  unsigned long usec; /* recorded time of the transfers */
+  byte payload[RECORD_MAX_LEN];
+  char error[80];
+
+} replayer;
+
+/* transport wrapped by the recorder, and session file */
+static const pickit_transport *recorded;
+static const char *record_path;
+
+
+/*
+ * write an entry and its payload.
+ */
+static void
+record_put (FILE *fp, const record_entry *e, const byte *payload)
+{
+  byte h[RECORD_HEAD_LEN];
+  unsigned int n;
+
+  h[0] = e->dir;
+  h[1] = (byte)(e->len & 0xff);
+  h[2] = (byte)(e->len >> 8);
+  h[3] = (byte)(e->result & 0xff);
+  h[4] = (byte)((e->result >> 8) & 0xff);
+  h[5] = (byte)(e->start & 0xff);
+  h[6] = (byte)((e->start >> 8) & 0xff);
+  h[7] = (byte)((e->start >> 16) & 0xff);
+  h[8] = (byte)((e->start >> 24) & 0xff);
+  h[9] = (byte)(e->usec & 0xff);
+  h[10] = (byte)((e->usec >> 8) & 0xff);
+  h[11] = (byte)((e->usec >> 16) & 0xff);
+  h[12] = (byte)((e->usec >> 24) & 0xff);
+
+  if (e->dir == '>')
+    n = e->len;
+  else
+    n = e->result > 0 ? e->result : 0;
+
+  fwrite (h, 1, RECORD_HEAD_LEN, fp);
+  fwrite (payload, 1, n, fp);
+}
+
+/*
+ * read an entry and its payload.  returns 0 at the end of the
+ * session, -1 if it is damaged.
+ */
+static int
+record_get (FILE *fp, record_entry *e, byte *payload)
+{
+  byte h[RECORD_HEAD_LEN];
+  unsigned int n;
+  size_t r;
+
+  r = fread (h, 1, RECORD_HEAD_LEN, fp);
+  if (r == 0)
+    return 0;
+
+  if (r != RECORD_HEAD_LEN || (h[0] != '>' && h[0] != '<'))
+    return -1;
+
+  e->dir = h[0];
+  e->len = h[1] | (h[2] << 8);
+  e->result = (short)(h[3] | (h[4] << 8));
+  e->start = h[5] | (h[6] << 8) | ((unsigned long)h[7] << 16)
+    | ((unsigned long)h[8] << 24);
+  e->usec = h[9] | (h[10] << 8) | ((unsigned long)h[11] << 16)
+    | ((unsigned long)h[12] << 24);
+
+  if (e->dir == '>')
+    n = e->len;
+  else
+    n = e->result > 0 ? e->result : 0;
+
+  if (n > RECORD_MAX_LEN || fread (payload, 1, n, fp) != n)
+    return -1;
+
+  return 1;
+}
+
+/*
+ * open the session file for reading.
+ */
+static FILE *
+record_open (const char *path)
+{
+  char magic[4];
+  FILE *fp;
+
+  fp = fopen (path, "rb");
+  if (!fp)
+    {
+      perror ("Could not open session file");
+      return NULL;
+    }
+
+  if (fread (magic, 1, 4, fp) != 4 || memcmp (magic, "PK1S", 4) != 0)
+    {
+      fprintf (stderr, "Error: %s is not a session file\n", path);
+      fclose (fp);
+      return NULL;
+    }
+
+  return fp;
+}
+
+
+/*
+ * open the recorded transport and the session file.
+ */
+static void *
+recorder_open (int unit)
+{
+  recorder *r;
+  char *path;
+
+  r = (recorder *)malloc (sizeof (recorder));
+  path = pickit_unit_path (record_path, unit);
+  if (!r || !path)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      free (r);
+      free (path);
+      return NULL;
+    }
+
+  r->fp = fopen (path, "wb");
+  free (path);
+  if (!r->fp)
+    {
+      perror ("Could not create session file");
+      free (r);
+      return NULL;
+    }
+
+  r->t = recorded;
+  r->h = recorded->open (unit);
+  if (!r->h)
+    {
+      fclose (r->fp);
+      free (r);
+      return NULL;
+    }
+
+  fwrite ("PK1S", 1, 4, r->fp);
+  r->t0 = pickit_clock ();
+  r->usec = 0;
+  r->modeled = r->t->stats != NULL;
+  r->now = 0;
+
+  if (r->modeled)
+    {
+      pickit_stats st;
+
+      memset (&st, 0, sizeof (st));
+      r->t->stats (r->h, &st);
+      r->now = st.usec;
+    }
+
+  return r;
+}
+
+/*
+ * time a transfer, from its start (set by the caller on the
+ * monotonic clock).
+ */
+static void
+recorder_time (recorder *r, record_entry *e)
+{
+  if (r->modeled)
+    {
+      pickit_stats st;
+
+      memset (&st, 0, sizeof (st));
+      r->t->stats (r->h, &st);
+
+      e->start = r->now;
+      e->usec = st.usec - r->now;
+      r->now = st.usec;
+    }
+  else
+    {
+      e->usec = pickit_clock () - e->start;
+      e->start -= r->t0;
+    }
+
+  r->usec += e->usec;
+}
+
+static int
+recorder_write (void *h, const byte *src, int len)
+{
+  recorder *r = (recorder *)h;
+  record_entry e;
+
+  e.dir = '>';
+  e.len = len;
+  e.start = pickit_clock ();
+  e.result = r->t->write (r->h, src, len);
+  recorder_time (r, &e);
+
+  record_put (r->fp, &e, src);
+
+  return e.result;
+}
+
+static int
+recorder_read (void *h, byte *dest, int len)
+{
+  recorder *r = (recorder *)h;
+  record_entry e;
+
+  e.dir = '<';
+  e.len = len;
+  e.start = pickit_clock ();
+  e.result = r->t->read (r->h, dest, len);
+  recorder_time (r, &e);
+
+  record_put (r->fp, &e, dest);
+
+  return e.result;
+}
+
+/*
+ * the recorded transport's PICkits.
+ */
+static int
+recorder_count ()
+{
+  return recorded->count ();
+}
+
+static int
+recorder_close (void *h)
+{
+  recorder *r = (recorder *)h;
+  int ok = r->t->close (r->h);
+
+  if (fclose (r->fp) != 0)
+    {
+      perror ("Could not write session file");
+      ok = 0;
+    }
+
+  free (r);
+  return ok;
+}
+
+static const char *
+recorder_error (void *h)
+{
+  recorder *r = (recorder *)h;
+
+  return r->t->error (r->h);
+}
+
+/*
+ * the recorded transport's stats, else the measured time.
+ */
+static void
+recorder_stats (void *h, pickit_stats *st)
+{
+  recorder *r = (recorder *)h;
+
+  if (r->t->stats)
+    r->t->stats (r->h, st);
+
+  if (!st->usec)
+    st->usec = r->usec;
+}
+
+static const pickit_transport pickit_recorder = {
+  "record",
+  recorder_count,
+  recorder_open,
+  recorder_write,
+  recorder_read,
+  recorder_close,
+  recorder_error,
+  recorder_stats
+};
+
+/*
+ * record the sessions of this transport.
+ */
+const pickit_transport *
+pickit_record (const pickit_transport *t, const char *path)
+{
+  recorded = t;
+  record_path = path;
+
+  return &pickit_recorder;
+}
+
+
+/*
+ * count the session files of PICKIT_REPLAY, one per PICkit.
+ */
+static int
+replayer_count ()
+{
+  const char *path = getenv ("PICKIT_REPLAY");
+  char *unit_path;
+  FILE *fp;
+  int n = 0;
+
+  if (!path)
+    return 0;
+
+  for (;;)
+    {
+      unit_path = pickit_unit_path (path, n);
+      if (!unit_path)
+	break;
+
+      fp = fopen (unit_path, "rb");
+      free (unit_path);
+      if (!fp)
+	break;
+
+      fclose (fp);
+      n++;
+    }
+
+  return n;
+}
+
+/*
+ * open the session of this unit.
+ */
+static void *
+replayer_open (int unit)
+{
+  const char *path = getenv ("PICKIT_REPLAY");
+  replayer *p;
+
+  if (!path)
+    {
+      fprintf (stderr, "Error: PICKIT_REPLAY does not name a "
+	       "session file\n");
+      return NULL;
+    }
+
+  p = (replayer *)calloc (1, sizeof (replayer));
+  if (p)
+    p->path = pickit_unit_path (path, unit);
+
+  if (!p || !p->path)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      free (p);
+      return NULL;
+    }
+
+  p->fp = record_open (p->path);
+  if (!p->fp)
+    {
+      free (p->path);
+      free (p);
+      return NULL;
+    }
+
+  printf ("replaying session %s\n", p->path);
+
+  return p;
+}
+
+/*
+ * get the next entry, which must go in direction dir and be of len
+ * bytes.
+ */
+static int
+replayer_next (replayer *p, byte dir, int len, record_entry *e)
+{
+  int r = record_get (p->fp, e, p->payload);
+
+  if (r <= 0)
+    {
+      sprintf (p->error, "session %s at transfer %lu",
+	       r ? "damaged" : "ended", p->n + 1);
+      return 0;
+    }
+
+  p->n++;
+  p->usec += e->usec;
+
+  if (e->dir != dir || e->len != (unsigned int)len)
+    {
+      sprintf (p->error, "session diverges at transfer %lu", p->n);
+      return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * check an OUT transfer against the session.
+ */
+static int
+replayer_write (void *h, const byte *src, int len)
+{
+  replayer *p = (replayer *)h;
+  record_entry e;
+
+  if (!replayer_next (p, '>', len, &e))
+    return -1;
+
+  if (memcmp (src, p->payload, len) != 0)
+    {
+      sprintf (p->error, "session diverges at transfer %lu", p->n);
+      return -1;
+    }
+
+  if (e.result < 0)
+    sprintf (p->error, "recorded error at transfer %lu", p->n);
+
+  return e.result;
+}
+
+/*
+ * give back an IN transfer of the session.
+ */
+static int
+replayer_read (void *h, byte *dest, int len)
+{
+  replayer *p = (replayer *)h;
+  record_entry e;
+
+  if (!replayer_next (p, '<', len, &e))
+    return -1;
+
+  if (e.result > 0)
+    memcpy (dest, p->payload, e.result);
+  else
+    sprintf (p->error, "recorded error at transfer %lu", p->n);
+
+  return e.result;
+}
+
+static int
+replayer_close (void *h)
+{
+  replayer *p = (replayer *)h;
+  record_entry e;
+  int ok = 1;
+
+  if (record_get (p->fp, &e, p->payload) != 0)
+    {
+      fprintf (stderr, "Warning: session %s has transfers left\n",
+	       p->path);
+      ok = 0;
+    }
+
+  fclose (p->fp);
+  free (p->path);
+  free (p);
+
+  return ok;
+}
+
+static const char *
+replayer_error (void *h)
+{
+  return ((replayer *)h)->error;
+}
+
+/*
+ * the recorded time.
+ */
+static void
+replayer_stats (void *h, pickit_stats *st)
+{
+  st->usec = ((replayer *)h)->usec;
+}
+
+const pickit_transport pickit_replayer = {
+  "replay",
+  replayer_count,
+  replayer_open,
+  replayer_write,
+  replayer_read,
+  replayer_close,
+  replayer_error,
+  replayer_stats
+};
+
+
+/* phases of a session, by the commands of the OUT transfers */
+enum record_phase {
+  PHASE_ERASE,
+  PHASE_WRITE_PROGRAM,
+  PHASE_WRITE_EEPROM,
+  PHASE_CHECKSUM,
+  PHASE_READ_PROGRAM,
+  PHASE_READ_EEPROM,
+  PHASE_CONTROL,
+  PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+  "erase",
+  "write program",
+  "write EEPROM",
+  "checksum",
+  "read program",
+  "read EEPROM",
+  "control"
+};
+
+/*
+ * the phase of an OUT transfer: its slowest command.
+ */
+static int
+record_phase (const byte *p, unsigned int len)
+{
+  int phase = PHASE_CONTROL;
+  unsigned int k = 0;
+
+  while (k < len)
+    {
+      int c = p[k++];
+
+      switch (c)
+	{
+	case 'E':
+	case 'e':
+	  return PHASE_ERASE;
+
+	case 'W':
+	  if (phase > PHASE_WRITE_PROGRAM)
+	    phase = PHASE_WRITE_PROGRAM;
+	  k += 2;
+	  break;
+
+	case 'D':
+	  if (phase > PHASE_WRITE_EEPROM)
+	    phase = PHASE_WRITE_EEPROM;
+	  k += 1;
+	  break;
+
+	case 'S':
+	  if (phase > PHASE_CHECKSUM)
+	    phase = PHASE_CHECKSUM;
+	  k += 4;
+	  break;
+
+	case 'R':
+	  if (phase > PHASE_READ_PROGRAM)
+	    phase = PHASE_READ_PROGRAM;
+	  break;
+
+	case 'r':
+	  if (phase > PHASE_READ_EEPROM)
+	    phase = PHASE_READ_EEPROM;
+	  break;
+
+	case 'I':
+	  k += 2;
+	  break;
+
+	case 'V':
+	  k += 1;
+	  break;
+	}
+    }
+
+  return phase;
+}
+
+/*
+ * print a session's transfers and where its time went.  IN transfers
+ * count in the phase of the OUT transfer before them.
+ */
+int
+pickit_record_report (const char *path, bool verbose)
+{
+  unsigned long transfers[PHASE_COUNT], bytes[PHASE_COUNT];
+  unsigned long usec[PHASE_COUNT];
+  unsigned long total = 0, end = 0, n = 0, errors = 0;
+  static byte payload[RECORD_MAX_LEN];
+  record_entry e;
+  int phase = PHASE_CONTROL, i, r;
+  FILE *fp;
+
+  fp = record_open (path);
+  if (!fp)
+    return 0;
+
+  memset (transfers, 0, sizeof (transfers));
+  memset (bytes, 0, sizeof (bytes));
+  memset (usec, 0, sizeof (usec));
+
+  while ((r = record_get (fp, &e, payload)) > 0)
+    {
+      if (e.dir == '>')
+	phase = record_phase (payload, e.len);
+
+      n++;
+      transfers[phase]++;
+      bytes[phase] += e.len;
+      usec[phase] += e.usec;
+      total += e.usec;
+      end = e.start + e.usec;
+
+      if (e.result != (int)e.len)
+	errors++;
+
+      if (verbose)
+	{
+	  unsigned int j;
+
+	  printf ("%10lu.%03lu ms %c %4u %7lu us %-13s",
+		  e.start / 1000, e.start % 1000, e.dir, e.len, e.usec,
+		  phase_names[phase]);
+
+	  for (j = 0; j < e.len && j < 16; ++j)
+	    printf (" %02x", payload[j]);
+	  printf ("%s\n", e.len > 16 ? " ..." : "");
+	}
+    }
+
+  fclose (fp);
+
+  if (r < 0)
+    fprintf (stderr, "Warning: session %s is damaged after transfer %lu\n",
+	     path, n);
+
+  printf ("%lu transfers, %lu failed, %lu.%03lu ms in transfers "
+	  "of %lu.%03lu ms\n", n, errors, total / 1000, total % 1000,
+	  end / 1000, end % 1000);
+
+  printf ("%-14s %9s %9s %12s %6s\n", "phase", "transfers", "bytes",
+	  "time (ms)", "share");
+
+  for (i = 0; i < PHASE_COUNT; ++i)
+    {
+      if (!transfers[i])
+	continue;
+
+      printf ("%-14s %9lu %9lu %8lu.%03lu %5.1f%%\n", phase_names[i],
+	      transfers[i], bytes[i], usec[i] / 1000, usec[i] % 1000,
+	      total ? 100.0 * usec[i] / total : 0.0);
+    }
+
+  if (end > total)
+    printf ("%-14s %9s %9s %8lu.%03lu\n", "between", "", "",
+	    (end - total) / 1000, (end - total) % 1000);
+
+  return r == 0;
+}
@@ -24,28 +24,89 @@
 #endif /* PATH_MAX */
 
 #include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include <usb.h>
 #include "common.h"
 #include "usb_pickit.h"
+#include "transport.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #define sleep(n) Sleep((n)*1000)
+#else
+#include <unistd.h>
 #endif
 
-/* PICkit USB values */
-const static int pickit_vendorID = 0x04d8; /* Microchip, Inc */
-const static int pickit_productID = 0x0032; /* PICkit 1 FLASH starter kit */
-const static int pickit_configuration = 2; /* 1: HID; 2: vendor specific */
-const static int pickit_interface = 0;
-const static int pickit_endpoint_out = 1; /* endpoint 1 address for OUT */
-const static int pickit_endpoint_in = 0x81; /* endpoint 0x81 address for IN */
-const static int pickit_timeout = 1000; /* timeout in ms */
-
 /* PICkit always uses 8-byte transfers */
 #define REQ_LEN 8
 
+/* number of command packets queued before they go out as a single
+   interrupt transfer */
+#define QUEUE_LEN 8
+
+/* packet plans (see usb_pickit_compile) */
+#define PLAN_VERSION 1
+#define PLAN_MAX_HOLES 4
+
+/* what fills a hole in a plan at replay */
+#define PLAN_HOLE_OSCCAL 1 /* the device's OSCCAL word */
+#define PLAN_HOLE_CONFIG 2 /* CONFIG word, bandgap bits from the device */
+
+/*
+ * a word of a plan's packets which is only known at replay.  offset
+ * is the position of the word's low byte in the packet.
+ */
+typedef struct
+{
+  unsigned int packet;
+  byte offset;
+  byte kind;
+} usb_pickit_hole;
+
+/*
+ * the packets recorded for a write, in the order they are sent.
+ */
+typedef struct
+{
+  byte *packets;
+  unsigned int count; /* number of packets */
+  unsigned int size; /* number of packets allocated */
+
+  usb_pickit_hole hole[PLAN_MAX_HOLES];
+  unsigned int holes;
+
+  bool failed; /* out of memory or holes */
+} usb_pickit_plan;
+
+/*
+ * an opened PICkit.  commands are appended to the packet being
+ * built until the next one does not fit, so consecutive commands
+ * share packets and 'Z' padding is only needed where a reply must be
+ * read or the queue flushed.  packets are not written one by one:
+ * they are queued and sent in one transfer of up to QUEUE_LEN
+ * packets, so the host controller streams them to the firmware
+ * without waiting a round trip between packets.  the queue is
+ * flushed before every read and whenever it is full.
+ */
+struct usb_pickit
+{
+  const pickit_transport *t;
+  void *handle; /* the transport's */
+  pickit_stats stats; /* traffic so far */
+
+  byte packet[REQ_LEN]; /* packet being built */
+  int fill; /* number of command bytes in packet */
+
+  byte queue[QUEUE_LEN * REQ_LEN]; /* pending OUT packets */
+  int queued; /* number of bytes in queue */
+
+  usb_pickit_plan *plan; /* if set, packets are recorded, not sent */
+
+  jmp_buf *on_error; /* if set, transfer errors jump there */
+  bool quiet; /* no progress output */
+};
+
 /*
  * Firmware 2.0.2 implements thirteen commands:
  *
@@ -77,154 +138,362 @@ const static int pickit_timeout = 1000; /* timeout in ms */
 
 
 /*
- * Stupidity:
- *  In an excellent example of sacrificing backward compatability
- * for conformance to some proported "standard", the latest Linux
- * kernel USB drivers (uhci-alternate in 2.4.24+, and uhci in 2.6.x)
- * no longer support low speed bulk mode transfers -- they give
- * "invalid argument", errno = -22, on any attempt to do a low speed
- * bulk write.  Thus, we need interrupt mode transfers, which are
- * only available via the CVS version of libusb.
- *
- * (Thanks to Steven Michalske for diagnosing the true problem here.)
+ * give up on a transfer: jump to the caller which asked for it, else
+ * end the program.  what is queued is dropped.
+ */
+static void
+usb_pickit_fail (usb_pickit *d)
+{
+  int rc = errno ? errno : EXIT_FAILURE;
+
+  d->queued = 0;
+  d->fill = 0;
+
+  if (d->on_error)
+    longjmp (*d->on_error, 1);
+
+  exit (rc);
+}
+
+/*
+ * write all queued command packets to PICKit in one transfer.
  */
+static void
+write_usb (usb_pickit *d)
+{
+  int r;
+
+  if (d->queued == 0)
+    return;
+
+  r = d->t->write (d->handle, d->queue, d->queued);
+
+  if (r != d->queued)
+    {
+      fprintf (stderr, "USB PICKit write: %s\n", d->t->error (d->handle));
+      usb_pickit_fail (d);
+    }
+
+  d->stats.writes++;
+  d->stats.packets += d->queued / REQ_LEN;
+  d->queued = 0;
+}
 
 /*
- * JEB - Note here, for the Mac, there is no interrupt mode, so need to set this
- * define to zero to get it to compile.  I use Mac OS X.
+ * append a packet to the plan being recorded.
  */
-#ifndef HAVE_LIBUSB_INTERRUPT_MODE
-#define HAVE_LIBUSB_INTERRUPT_MODE 1
-#endif
+static void
+plan_append (usb_pickit_plan *plan, const byte *src)
+{
+  if (plan->count == plan->size)
+    {
+      unsigned int size = plan->size ? plan->size * 2 : 256;
+      byte *packets = (byte *)realloc (plan->packets, size * REQ_LEN);
 
-#if HAVE_LIBUSB_INTERRUPT_MODE
-/* latest libusb: interrupt mode, works with all kernels */
-#define PICKIT_USB(direction) usb_interrupt_##direction
-#else
-/* older libusb: bulk mode, will only work with older kernels */
-#define PICKIT_USB(direction) usb_bulk_##direction
-#endif
+      if (!packets)
+	{
+	  plan->failed = 1;
+	  return;
+	}
+
+      plan->packets = packets;
+      plan->size = size;
+    }
 
+  memcpy (plan->packets + plan->count * REQ_LEN, src, REQ_LEN);
+  plan->count++;
+}
+
+/*
+ * queue a 8-byte command packet for PICKit.
+ */
+static void
+send_usb (usb_pickit *d, const byte *src)
+{
+  if (d->plan)
+    {
+      plan_append (d->plan, src);
+      return;
+    }
+
+  memcpy (d->queue + d->queued, src, REQ_LEN);
+  d->queued += REQ_LEN;
+
+  if (d->queued == QUEUE_LEN * REQ_LEN)
+    write_usb (d);
+}
+
+/*
+ * close the packet being built: pad it with null commands and
+ * queue it.
+ */
+static void
+cmd_end (usb_pickit *d)
+{
+  if (d->fill == 0)
+    return;
+
+  memset (d->packet + d->fill, 'Z', REQ_LEN - d->fill);
+  send_usb (d, d->packet);
+  d->fill = 0;
+}
+
+/*
+ * write the packet being built and all queued packets to PICKit.
+ */
+static void
+flush_usb (usb_pickit *d)
+{
+  cmd_end (d);
+  write_usb (d);
+}
+
+/*
+ * append one command of len bytes (command and arguments).  a
+ * command is never split across two packets.
+ */
+static void
+cmd_put (usb_pickit *d, const byte *cmd, int len)
+{
+  if (d->fill + len > REQ_LEN)
+    cmd_end (d);
+
+  memcpy (d->packet + d->fill, cmd, len);
+  d->fill += len;
+}
 
 /*
- * send a 8-byte command packet to PICKit.
+ * when recording a plan, mark the word argument of the 'W' command
+ * appended next as a hole of this kind.
  */
 static void
-send_usb (usb_pickit *d, const char *src)
+cmd_hole (usb_pickit *d, byte kind)
 {
-  int r = PICKIT_USB(write)(d, pickit_endpoint_out, (char *)src,
-			    REQ_LEN, pickit_timeout);
+  usb_pickit_plan *plan = d->plan;
+
+  if (!plan)
+    return;
+
+  /* the 'W' must start where the hole is recorded */
+  if (d->fill + 3 > REQ_LEN)
+    cmd_end (d);
 
-  if (r != REQ_LEN)
+  if (plan->holes == PLAN_MAX_HOLES)
+    {
+      plan->failed = 1;
+      return;
+    }
+
+  plan->hole[plan->holes].packet = plan->count;
+  plan->hole[plan->holes].offset = (byte)(d->fill + 1);
+  plan->hole[plan->holes].kind = kind;
+  plan->holes++;
+}
+
+/*
+ * append a sequence of commands which have no or character
+ * arguments, like "pV0V1PC".
+ */
+static void
+cmd_send (usb_pickit *d, const char *cmds)
+{
+  while (*cmds)
     {
-      fprintf (stderr, "USB PICKit write: %s\n", usb_strerror ());
-      exit (errno);
+      /* 'V' is the only such command with an argument */
+      int len = (*cmds == 'V') ? 2 : 1;
+
+      cmd_put (d, (const byte *)cmds, len);
+      cmds += len;
     }
 }
 
 /*
- * write the next program counter with this word.
+ * append command c followed by the little-endian word w
+ * ('I' and 'W').
+ */
+static void
+cmd_word (usb_pickit *d, char c, pic14_word w)
+{
+  byte cmd[3];
+
+  cmd[0] = (byte)c;
+  cmd[1] = (byte)(w & 0xff);
+  cmd[2] = (byte)((w >> 8) & 0xff);
+
+  cmd_put (d, cmd, 3);
+}
+
+/*
+ * append an EEPROM data write of byte b.
+ */
+static void
+cmd_data (usb_pickit *d, pic14_word b)
+{
+  byte cmd[2];
+
+  cmd[0] = 'D';
+  cmd[1] = (byte)(b & 0xff);
+
+  cmd_put (d, cmd, 2);
+}
+
+/*
+ * append a checksum request over inst_len program words and ee_len
+ * data bytes.  the firmware replies with a 8-byte packet.
  */
 static void
-send_usb_word (usb_pickit *d, pic14_word w)
+cmd_checksum (usb_pickit *d, pic14_addr inst_len, pic14_addr ee_len)
 {
-  char cmd[REQ_LEN + 1] = "W__ZZZZZ";
+  byte cmd[5];
 
-  cmd[1] = (char)(w & 0xff);
-  cmd[2] = (char)((w >> 8) & 0xff);
+  cmd[0] = 'S';
+  cmd[1] = (byte)(inst_len & 0xff);
+  cmd[2] = (byte)(inst_len >> 8);
+  cmd[3] = (byte)(ee_len & 0xff);
+  cmd[4] = (byte)(ee_len >> 8);
+
+  cmd_put (d, cmd, 5);
+}
+
+/*
+ * append n (up to eight) read commands c ('R' or 'r').  they are
+ * kept in one packet, which becomes the last one sent before the
+ * replies are read.
+ */
+static void
+cmd_read (usb_pickit *d, char c, unsigned int n)
+{
+  byte cmd[REQ_LEN];
 
-  send_usb (d, cmd);
+  memset (cmd, c, n);
+  cmd_put (d, cmd, n);
 }
 
 /*
- * write the next n program counters with these words.
+ * write the next n program counters with these words.  the device
+ * must have been erased: blank words (0x3fff) are not written, runs
+ * of them are jumped over with one 'I' instead of a 4 ms write each.
+ * returns the number of words skipped.
  * JEB - I like the way that MAR added the '.' that print out during
  * the write, nice touch.
  */
-static void
+static unsigned int
 send_usb_words (usb_pickit *d, unsigned int n, pic14_word *w)
 {
-  unsigned int i;
-  char cmd[REQ_LEN + 1] = "W__W__ZZ";
+  unsigned int i, run = 0, skipped = 0, written = 0;
 
-  /* send words two by two in a 8-byte packet */
-  for (i = 0; i < n / 2; ++i)
+  for (i = 0; i < n; ++i)
     {
-      /* pick two words to send */
-      pic14_word w1 = w[i * 2 + 0];
-      pic14_word w2 = w[i * 2 + 1];
+      if ((w[i] & 0x3fff) == 0x3fff)
+	{
+	  run++;
+	  continue;
+	}
 
-      printf ("."); /* MAR add */
-      fflush (stdout);
+      if (run)
+	{
+	  cmd_word (d, 'I', run);
+	  skipped += run;
+	  run = 0;
+	}
 
-      cmd[1] = (char)(w1 & 0xff);
-      cmd[2] = (char)((w1 >> 8) & 0xff);
+      if (written++ % 2 == 0 && !d->quiet)
+	{
+	  printf ("."); /* MAR add */
+	  fflush (stdout);
+	}
 
-      cmd[4] = (char)(w2 & 0xff);
-      cmd[5] = (char)((w2 >> 8) & 0xff);
+      cmd_word (d, 'W', w[i]);
+    }
 
-      send_usb (d, cmd);
+  /* leave the pc after the last word, as if all were written */
+  if (run)
+    {
+      cmd_word (d, 'I', run);
+      skipped += run;
     }
 
-  /* if the number of words to send is odd,
-     send the last one */
-  if (n % 2)
-    send_usb_word (d, w[n - 1]);
+  if (!d->quiet)
+    printf ("\n"); /* MAR add */
 
-  printf ("\n"); /* MAR add */
+  return skipped;
 }
 
 /*
- * read len bytes from the device
+ * read len bytes from the device.  the commands asking for them
+ * must be in the last packet: the firmware does not take further
+ * packets until its reply has been read.
  */
 static void
 recv_usb (usb_pickit *d, int len, byte *dest)
 {
-  int r = PICKIT_USB(read)(d, pickit_endpoint_in, (char *)dest,
-			   len, pickit_timeout);
+  int r;
+
+  /* the firmware answers only once it got the request */
+  flush_usb (d);
+
+  r = d->t->read (d->handle, dest, len);
 
   if (r != len)
     {
-      fprintf (stderr, "USB PICKit read: %s\n", usb_strerror ());
-      exit (errno);
+      fprintf (stderr, "USB PICKit read: %s\n", d->t->error (d->handle));
+      usb_pickit_fail (d);
     }
+
+  d->stats.reads++;
+  d->stats.bytes += len;
 }
 
 /*
- * read 4 words from the current address
+ * read len words from the device.  each 'R' returns 4 words, so up
+ * to 32 words are fetched per round trip.  only the requested words
+ * are copied out of the last batch.
  */
 static void
-recv_usb_words4 (usb_pickit *d, pic14_word *dest)
+recv_usb_words (usb_pickit *d, unsigned int len, pic14_word *dest)
 {
-  int i;
-  byte buffer[REQ_LEN];
+  while (len > 0)
+    {
+      byte buffer[REQ_LEN * REQ_LEN];
+      unsigned int i, n, c = 4 * REQ_LEN; /* number of words to copy out */
 
-  send_usb (d, "RZZZZZZZ");
-  recv_usb (d, REQ_LEN, buffer);
+      if (c > len)
+	c = len;
 
-  /* reconstitute the 4 words from the 8 bytes received */
-  for (i = 0; i < 4; ++i)
-    dest[i] = buffer[2 * i + 0] + (buffer[2 * i + 1] << 8);
+      /* read next batch of up to 8 x 4 words */
+      n = (c + 3) / 4;
+      cmd_read (d, 'R', n);
+      recv_usb (d, n * REQ_LEN, buffer);
+
+      /* reconstitute the words from the bytes received */
+      for (i = 0; i < c; ++i)
+	dest[i] = buffer[2 * i + 0] + (buffer[2 * i + 1] << 8);
+
+      dest += c;
+      len -= c;
+    }
 }
 
 /*
- * read len words from the device
+ * read len EEPROM bytes from the device.  each 'r' returns 8 bytes,
+ * so up to 64 bytes are fetched per round trip.
  */
 static void
-recv_usb_words (usb_pickit *d, unsigned int len, pic14_word *dest)
+recv_usb_eeprom (usb_pickit *d, unsigned int len, pic14_word *dest)
 {
   while (len > 0)
     {
-      pic14_word buffer[4];
-      unsigned int i, c = 4; /* number of words to copy out */
-
-      /* read next four words */
-      recv_usb_words4 (d, buffer);
+      byte buffer[REQ_LEN * REQ_LEN];
+      unsigned int i, n, c = REQ_LEN * REQ_LEN; /* bytes to copy out */
 
       if (c > len)
 	c = len;
 
-      /* copy them to destination buffer */
+      /* read next batch of up to 8 x 8 bytes */
+      n = (c + REQ_LEN - 1) / REQ_LEN;
+      cmd_read (d, 'r', n);
+      recv_usb (d, n * REQ_LEN, buffer);
+
       for (i = 0; i < c; ++i)
 	dest[i] = buffer[i];
 
@@ -237,24 +506,10 @@ recv_usb_words (usb_pickit *d, unsigned int len, pic14_word *dest)
  * initialize USB connection with PICKit
  */
 static int
-usb_pickit_init (usb_dev_handle *d)
+usb_pickit_init (usb_pickit *d)
 {
   byte version[REQ_LEN];
 
-  /* set the configuration for USB PICKit */
-  if (usb_set_configuration (d, pickit_configuration) < 0)
-    {
-      fprintf (stderr, "%s\n", usb_strerror ());
-      return 0;
-    }
-
-  /* this is our device, claim it */
-  if (usb_claim_interface (d, pickit_interface) < 0)
-    {
-      fprintf (stderr, "%s\n", usb_strerror ());
-      return 0;
-    }
-
   /*
    * turn off power to the chip before doing anything.
    * this prevents weird random errors during programming.
@@ -263,7 +518,7 @@ usb_pickit_init (usb_dev_handle *d)
   usb_pickit_off (d);
 
   /* read firmware version */
-  send_usb (d, "vZZZZZZZ");
+  cmd_send (d, "v");
   recv_usb (d, REQ_LEN, version);
 
   printf ("communication established, "
@@ -280,107 +535,86 @@ usb_pickit_init (usb_dev_handle *d)
 }
 
 /*
- * find the first USB device with this vendor and
- * product.  exits on errors, like if the device couldn't be found.
+ * the transport named by the PICKIT_TRANSPORT environment variable
+ * (libusb if not set).  if PICKIT_RECORD names a file, sessions are
+ * recorded to it.
+ */
+static const pickit_transport *
+usb_pickit_transport ()
+{
+  const pickit_transport *t;
+  const char *record;
+
+  t = pickit_transport_find (getenv ("PICKIT_TRANSPORT"));
+  if (!t)
+    return NULL;
+
+  record = getenv ("PICKIT_RECORD");
+  if (record && *record)
+    t = pickit_record (t, record);
+
+  return t;
+}
+
+/*
+ * count the PICKits attached.
+ */
+int
+usb_pickit_count ()
+{
+  const pickit_transport *t = usb_pickit_transport ();
+
+  return t ? t->count () : 0;
+}
+
+/*
+ * open the first PICKit.
  */
 usb_pickit *
 usb_pickit_open ()
 {
-  struct usb_device *device;
-  struct usb_bus *bus;
-#if 0
-#ifndef _WIN32
-  /* ensure user have root privileges for executing this program */
-  if (geteuid () != 0)
-    {
-      fprintf (stderr, "this program must be run as root, "
-	       "or made setuid root\n");
-      return NULL;
-    }
-#endif /* _WIN32 */
-#endif
-  /* announce what we are looking for */
-  printf ("Locating USB Microchip(tm) PICkit(tm) "
-	  "(vendor 0x%04x/product 0x%04x)\n",
-	  pickit_vendorID, pickit_productID);
-
-  /* libusb setup code stolen from John Fremlin's cool "usb-robot" */
-  usb_init ();
-#ifdef DEBUG
-  usb_set_debug (4);
-#endif
-  usb_find_busses ();
-  usb_find_devices ();
+  return usb_pickit_open_unit (0);
+}
 
-  /* look through each bus */
-  for (bus = usb_busses; bus != NULL; bus = bus->next)
-    {
-      struct usb_device *usb_devices = bus->devices;
+/*
+ * open a PICKit, numbered from 0.
+ */
+usb_pickit *
+usb_pickit_open_unit (int unit)
+{
+  const pickit_transport *t;
+  usb_pickit *d;
+  void *h;
 
-      /* look through each device of this bus */
-      for (device = usb_devices; device != NULL;
-	   device = device->next)
-	{
-	  /* check if vendor ID and product ID correspond */
-	  if (device->descriptor.idVendor == pickit_vendorID &&
-	      device->descriptor.idProduct == pickit_productID)
-	    {
-	      /* we found PICKit! */
+  t = usb_pickit_transport ();
+  if (!t)
+    return NULL;
 
-	      int retval;
-	      char dname[32] = {0};
-	      usb_dev_handle *d;
+  h = t->open (unit);
+  if (!h)
+    return NULL;
 
-	      printf ("found USB PICkit as device '%s' on USB bus %s\n",
-		      device->filename, device->bus->dirname);
+  d = (usb_pickit *)malloc (sizeof (usb_pickit));
+  if (!d)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      t->close (h);
+      return NULL;
+    }
 
-	      /* open the device */
-	      d = usb_open (device);
-	      if (!d)
-		{
-		  fprintf (stderr, "Error: failed to open USB device\n");
-		  fprintf (stderr, "%s\n", usb_strerror ());
-		  return NULL;
-		}
+  memset (d, 0, sizeof (usb_pickit));
+  d->t = t;
+  d->handle = h;
+  d->plan = NULL;
 
-#ifdef __linux__
-	      /* look if a driver doesn't already claim this interface */
-	      retval = usb_get_driver_np (d, 0, dname, 31);
-	      if (!retval)
-		{
-		  /* detach it so we can use the interface via libusb */
-		  usb_detach_kernel_driver_np (d, 0);
-
-		  /* reopen the device */
-		  usb_close (d);
-		  d = usb_open (device);
-		  if (!d)
-		    {
-		      fprintf (stderr, "Error: failed to open USB device\n");
-		      fprintf (stderr, "%s\n", usb_strerror ());
-		      return NULL;
-		    }
-		}
-#endif /* __linux__ */
-
-	      /* initialize USB connection with PICKit */
-	      if (!usb_pickit_init (d))
-		{
-		  usb_pickit_close (d);
-		  return NULL;
-		}
-
-	      return d;
-	    }
-	}
+  /* initialize USB connection with PICKit */
+  if (!usb_pickit_init (d))
+    {
+      usb_pickit_close (d);
+      return NULL;
     }
 
-  /* we looked through each device of each bus and didn't
-     find PICKit */
-
-  fprintf (stderr, "Could not find USB PICKit device!\n"
-	   "you might try lsusb to see if it's actually there.\n");
-  return NULL;
+  return d;
 }
 
 /*
@@ -389,31 +623,50 @@ usb_pickit_open ()
 void
 usb_pickit_close (usb_pickit *d)
 {
-  /* release claimed interface */
-  if (usb_release_interface (d, pickit_interface) < 0)
-    {
-      fprintf (stderr, "%s\n", usb_strerror ());
-      exit (EXIT_FAILURE);
-    }
+  const pickit_transport *t = d->t;
+  void *h = d->handle;
 
-#ifdef _WIN32
-  /* !!!HACK: for some reasons, the usb device need to be reset before
-     closing.  Otherwise, you'll have to deal with weird behaviours... */
-  if (usb_reset (d) < 0)
-    {
-      fprintf (stderr, "%s\n", usb_strerror ());
-      exit (EXIT_FAILURE);
-    }
+  /* send what is still queued */
+  flush_usb (d);
+  free (d);
 
-  return;
-#endif /* _WIN32 */
+  if (!t->close (h))
+    exit (EXIT_FAILURE);
+}
 
-  /* close usb device */
-  if (usb_close (d) < 0)
-    {
-      fprintf (stderr, "%s\n", usb_strerror ());
-      exit (EXIT_FAILURE);
-    }
+/*
+ * catch transfer errors.
+ */
+jmp_buf *
+usb_pickit_catch (usb_pickit *d, jmp_buf *env)
+{
+  jmp_buf *old = d->on_error;
+
+  d->on_error = env;
+  return old;
+}
+
+/*
+ * turn the progress output off or on.
+ */
+void
+usb_pickit_quiet (usb_pickit *d, bool quiet)
+{
+  d->quiet = quiet;
+}
+
+/*
+ * get the traffic since the PICKit was opened, sending what is
+ * still queued first.
+ */
+void
+usb_pickit_stats (usb_pickit *d, pickit_stats *st)
+{
+  flush_usb (d);
+  *st = d->stats;
+
+  if (d->t->stats)
+    d->t->stats (d->handle, st);
 }
 
 /*
@@ -422,7 +675,8 @@ usb_pickit_close (usb_pickit *d)
 void
 usb_pickit_on (usb_pickit *d)
 {
-  send_usb (d, "V1ZZZZZZ");
+  cmd_send (d, "V1");
+  flush_usb (d);
 }
 
 /*
@@ -431,7 +685,8 @@ usb_pickit_on (usb_pickit *d)
 void
 usb_pickit_off (usb_pickit *d)
 {
-  send_usb (d, "V0ZZZZZZ");
+  cmd_send (d, "V0");
+  flush_usb (d);
 }
 
 /*
@@ -440,7 +695,8 @@ usb_pickit_off (usb_pickit *d)
 void
 usb_pickit_osc_on (usb_pickit *d)
 {
-  send_usb (d, "V3ZZZZZZ");
+  cmd_send (d, "V3");
+  flush_usb (d);
 }
 
 /*
@@ -449,7 +705,71 @@ usb_pickit_osc_on (usb_pickit *d)
 void
 usb_pickit_osc_off (usb_pickit *d)
 {
-  send_usb (d, "V1ZZZZZZ");
+  cmd_send (d, "V1");
+  flush_usb (d);
+}
+
+/*
+ * read the 8 words of configuration memory at 0x2000: IDs, device ID
+ * at 0x2006 and CONFIG word at 0x2007.  power cycles the device, and
+ * leaves programming mode with the power off.
+ */
+static void
+usb_pickit_read_config_memory (usb_pickit *d, pic14_word *cfg)
+{
+  cmd_send (d, "pV0V1PC");
+  recv_usb_words (d, 8, cfg);
+  cmd_send (d, "p");
+}
+
+/*
+ * read the device ID word at 0x2006 alone, in one round trip, for
+ * polling the socket.  leaves the device powered off.
+ */
+pic14_word
+usb_pickit_read_device_id (usb_pickit *d)
+{
+  pic14_word id;
+
+  cmd_send (d, "pV0V1PC");
+  cmd_word (d, 'I', 6);
+  recv_usb_words (d, 1, &id);
+  cmd_send (d, "pV0");
+  flush_usb (d);
+
+  return id;
+}
+
+/*
+ * read the device ID once and tell what happened in the socket since
+ * the last read.  a chip counts as put in once the same known ID was
+ * read twice in a row, so that a chip still being pushed in is not
+ * taken for one.
+ */
+int
+usb_pickit_watch (usb_pickit *d, usb_pickit_socket *w)
+{
+  pic14_word id = usb_pickit_read_device_id (d);
+  int event = 0;
+
+  if (!pic14_get_device (id & 0xffe0))
+    {
+      if (w->present)
+	event = PICKIT_CHIP_OUT;
+
+      w->present = w->seen = 0;
+    }
+  else if (!w->present && w->seen && id == w->id)
+    {
+      w->present = 1;
+      event = PICKIT_CHIP_IN;
+    }
+  else
+    w->seen = 1;
+
+  w->id = id;
+
+  return event;
 }
 
 /*
@@ -473,12 +793,11 @@ usb_pickit_get_device (usb_pickit *d, pic14_device *dev)
   pic14_state *s = &dev->state;
   pic14_word id_word;
 
-  send_usb (d, "pV0V1PCZ");
-
-  /* read ID word from 0x2006 */
-  send_usb (d, "pPCI\x06\x00ZZ");
-  recv_usb_words (d, 1, &id_word);
-  send_usb (d, "pV1ZZZZZ");
+  /* read configuration memory, with the ID word at 0x2006, in the
+     same programming mode entry as the IDs and CONFIG word */
+  usb_pickit_read_config_memory (d, dev->cfg);
+  cmd_send (d, "V1");
+  id_word = dev->cfg[6];
 
   /* get revision value */
   dev->rev = id_word & 0x1f;
@@ -487,9 +806,10 @@ usb_pickit_get_device (usb_pickit *d, pic14_device *dev)
   const pic14_device_info *dinfo = pic14_get_device (id_word & 0xffe0);
   if (dinfo)
     {
-      /* found the device, copy values */
-      s->program.inst_len = dinfo->inst_len;
-      s->program.ee_len = dinfo->ee_len;
+      /* found the device, size its image and copy values */
+      if (!pic14_state_size (s, dinfo->inst_len, dinfo->ee_len))
+	return 0;
+
       s->config.save_osccal = dinfo->save_osccal;
       s->config.configmask = dinfo->configmask;
 
@@ -525,16 +845,7 @@ usb_pickit_get_device (usb_pickit *d, pic14_device *dev)
 void
 usb_pickit_calc_checksum (pic14_state *s)
 {
-  int i;
-
-  /* add the CONFIG word to the checksum */
-  s->program.instchecksum = (s->config.config & s->config.configmask);
-
-  /* sum all instruction words */
-  for (i = 0; i < s->program.inst_len; ++i)
-    s->program.instchecksum += s->program.inst[i];
-
-  s->program.instchecksum &= 0xffff;
+  pic14_calc_checksum (s);
 }
 
 /*
@@ -543,52 +854,137 @@ usb_pickit_calc_checksum (pic14_state *s)
 void
 usb_pickit_read_checksum (usb_pickit *d, pic14_state *s)
 {
-  pic14_word checksum[2];
-
-  /* fill in program and data length values */
-  char cmd[REQ_LEN + 1] = "S____V1Z";
-  cmd[1] = (char)(s->program.inst_len & 0xff);
-  cmd[2] = (char)(s->program.inst_len >> 8);
-  cmd[3] = (char)(s->program.ee_len & 0xff);
-  cmd[4] = (char)(s->program.ee_len >> 8);
+  byte checksum[REQ_LEN];
 
-  /* query for PICKit checksum computation */
-  send_usb (d, cmd);
-  recv_usb_words (d, 2, checksum);
-  send_usb (d, "pV1ZZZZZ");
+  /* query for PICKit checksum computation.  the reply is read
+     as is: an 'R' here would push a second packet behind it */
+  cmd_checksum (d, s->program.inst_len, s->program.ee_len);
+  recv_usb (d, REQ_LEN, checksum);
+  cmd_send (d, "pV1");
 
   /* save results into PIC's state */
-  s->config.pgmchecksum = checksum[0];
-  s->config.eechecksum = (byte)(checksum[1] & 0x00ff);
+  s->config.pgmchecksum = checksum[0] + (checksum[1] << 8);
+  s->config.eechecksum = checksum[2];
 }
 
 /*
- * read current EEPROM Data memory from the device.
+ * enter programming mode and move the pc to addr.
  */
-void
-usb_pickit_read_eeprom (usb_pickit *d, pic14_program *p)
+static void
+usb_pickit_seek (usb_pickit *d, pic14_addr addr)
 {
-  int nee = 0;
+  cmd_send (d, "P");
 
-  /* enter programming mode */
-  send_usb (d, "PZZZZZZZ");
+  if (addr > 0)
+    cmd_word (d, 'I', addr);
+}
+
+/*
+ * read a window of EEPROM Data memory (NULL: all of it) into the same
+ * place of p->ee, in one programming mode entry.
+ */
+static void
+usb_pickit_read_eeprom_entry (usb_pickit *d, pic14_program *p,
+			      const pic14_range *r)
+{
+  pic14_addr addr = r ? r->addr : 0;
+
+  p->summed = 0;
+  usb_pickit_seek (d, addr);
+  recv_usb_eeprom (d, r ? r->len : p->ee_len, p->ee + addr);
+  cmd_send (d, "p");
+}
+
+/*
+ * read a window of program memory (NULL: all of it, empty: none) into
+ * the same place of p->inst, and with osccal the OSCCAL word at 0x3ff,
+ * in one programming mode entry.  the pc only moves forward, so
+ * OSCCAL is read before the window if it lies below it, taken from
+ * the window if it is inside, or reached with 'I' after the window.
+ * since 'R' reads 4 words, a window ending just below 0x3ff is read
+ * up to OSCCAL at no cost.
+ */
+static void
+usb_pickit_read_program_entry (usb_pickit *d, pic14_program *p,
+			       const pic14_range *r, pic14_word *osccal)
+{
+  pic14_addr addr = r ? r->addr : 0, len = r ? r->len : p->inst_len;
+  pic14_addr pc = 0;
+
+  if (len > 0)
+    p->summed = 0;
+  cmd_send (d, "P");
+
+  if (osccal && addr > 0x03ff)
+    {
+      cmd_word (d, 'I', 0x03ff);
+      recv_usb_words (d, 1, osccal);
+      pc = 0x0400;
+      osccal = NULL;
+    }
 
-  /* read EEPROM data */
-  while (nee < p->ee_len)
+  if (len > 0)
     {
-      byte eeData[64];
-      int i;
+      if (osccal && addr + len <= 0x03ff &&
+	  addr + (len + 3) / 4 * 4 > 0x03ff)
+	len = 0x0400 - addr;
+
+      if (addr > pc)
+	cmd_word (d, 'I', addr - pc);
 
-      /* read 8x8 bytes from EE data memory */
-      send_usb (d, "rrrrrrrr");
-      recv_usb (d, 64, eeData);
+      recv_usb_words (d, len, p->inst + addr);
+      pc = addr + (len + 3) / 4 * 4;
 
-      for (i = 0; i < 64; ++i)
-	p->ee[nee++] = eeData[i];
+      if (osccal && addr + len > 0x03ff)
+	{
+	  *osccal = p->inst[0x03ff];
+	  osccal = NULL;
+	}
     }
 
-  /* exit programming mode */
-  send_usb (d, "pZZZZZZZ");
+  if (osccal)
+    {
+      if (0x03ff > pc)
+	cmd_word (d, 'I', 0x03ff - pc);
+
+      recv_usb_words (d, 1, osccal);
+    }
+
+  cmd_send (d, "p");
+}
+
+/*
+ * copy IDs and CONFIG word out of the configuration memory words.
+ */
+static void
+usb_pickit_config_from_memory (pic14_config *c, const pic14_word *cfg)
+{
+  int i;
+
+  for (i = 0; i < PIC14_ID_LEN; ++i)
+    c->id[i] = cfg[i];
+
+  c->config = cfg[7];
+}
+
+/*
+ * read current EEPROM Data memory from the device.
+ */
+void
+usb_pickit_read_eeprom (usb_pickit *d, pic14_program *p)
+{
+  usb_pickit_read_eeprom_range (d, p, NULL);
+}
+
+/*
+ * read a window of EEPROM Data memory from the device, into the
+ * same place of p->ee.
+ */
+void
+usb_pickit_read_eeprom_range (usb_pickit *d, pic14_program *p,
+			      const pic14_range *r)
+{
+  usb_pickit_read_eeprom_entry (d, p, r);
 }
 
 /*
@@ -597,14 +993,21 @@ usb_pickit_read_eeprom (usb_pickit *d, pic14_program *p)
 void
 usb_pickit_read_program (usb_pickit *d, pic14_program *p)
 {
-  /* enter programming mode */
-  send_usb (d, "PZZZZZZZ");
+  usb_pickit_read_program_range (d, p, NULL);
+}
 
-  /* read program memory */
-  recv_usb_words (d, p->inst_len, p->inst);
+/*
+ * read a window of program memory from the device, into the same
+ * place of p->inst.
+ */
+void
+usb_pickit_read_program_range (usb_pickit *d, pic14_program *p,
+			       const pic14_range *r)
+{
+  usb_pickit_read_program_entry (d, p, r, NULL);
 
-  /* exit programming mode; power on */
-  send_usb (d, "pV1ZZZZZ");
+  /* power on */
+  cmd_send (d, "V1");
 }
 
 /*
@@ -613,18 +1016,16 @@ usb_pickit_read_program (usb_pickit *d, pic14_program *p)
 void
 usb_pickit_read_config (usb_pickit *d, pic14_config *c)
 {
-  /* read OSCCAL from 0x03ff */
-  send_usb (d, "V0V1PI\xff\x03");
-  recv_usb_words (d, 1, &c->osccal);
+  pic14_range none = { 0, 0 };
+  pic14_word cfg[8];
 
-  /* read configuration IDs from 0x2000 */
-  send_usb (d, "pV0V1PCZ");
-  recv_usb_words (d, PIC14_ID_LEN, c->id);
+  /* read configuration IDs from 0x2000 and CONFIG word from 0x2007
+     in one go, then OSCCAL from 0x03ff */
+  usb_pickit_read_config_memory (d, cfg);
+  usb_pickit_read_program_entry (d, NULL, &none, &c->osccal);
+  cmd_send (d, "V1");
 
-  /* read CONFIG word from 0x2007 */
-  send_usb (d, "pPCI\x07\x00ZZ");
-  recv_usb_words (d, 1, &c->config);
-  send_usb (d, "pV1ZZZZZ");
+  usb_pickit_config_from_memory (c, cfg);
 }
 
 /*
@@ -634,58 +1035,103 @@ usb_pickit_read_config (usb_pickit *d, pic14_config *c)
 void
 usb_pickit_read (usb_pickit *d, pic14_state *s)
 {
-  usb_pickit_read_eeprom (d, &s->program);
-  usb_pickit_read_program (d, &s->program);
-  usb_pickit_read_config (d, &s->config);
+  usb_pickit_read_range (d, s, NULL, NULL);
 }
 
 /*
- * write this program's data to device's EEPROM.
+ * fill out this state with windows of the device's program and
+ * EEPROM Data memory, and its config words.
  */
 void
-usb_pickit_write_eeprom (usb_pickit *d, pic14_program *p)
+usb_pickit_read_range (usb_pickit *d, pic14_state *s,
+		       const pic14_range *prog, const pic14_range *ee)
 {
-  char cmd[REQ_LEN + 1];
-  unsigned int i, j;
+  pic14_word cfg[8];
 
-  /* enter programming mode */
-  send_usb (d, "PZZZZZZZ");
+  usb_pickit_read_config_memory (d, cfg);
+  usb_pickit_config_from_memory (&s->config, cfg);
 
-  /* write out the EEPROM data */
-  printf ("writing %d eeprom words\n", p->max_ee);
+  usb_pickit_read_eeprom_entry (d, &s->program, ee);
+  usb_pickit_read_program_entry (d, &s->program, prog, &s->config.osccal);
+  cmd_send (d, "V1");
+}
+
+/*
+ * continue the session usb_pickit_get_device started: fill out the
+ * device state with what is selected.  the configuration memory was
+ * read while identifying the device, so this costs at most one
+ * programming mode entry for EEPROM Data and one for program memory
+ * and OSCCAL.
+ */
+void
+usb_pickit_read_device (usb_pickit *d, pic14_device *dev, unsigned int what,
+			const pic14_range *prog, const pic14_range *ee)
+{
+  pic14_state *s = &dev->state;
+  pic14_range none = { 0, 0 };
+  pic14_word *osccal = NULL;
 
-  /* write data bytes to EEPROM four by four */
-  sprintf (cmd, "D_D_D_D_");
-  for (i = 0; i < p->max_ee / 4; ++i)
+  if (what & PICKIT_READ_CONFIG)
     {
-      cmd[1] = (char)(p->ee[i * 4 + 0]);
-      cmd[3] = (char)(p->ee[i * 4 + 1]);
-      cmd[5] = (char)(p->ee[i * 4 + 2]);
-      cmd[7] = (char)(p->ee[i * 4 + 3]);
+      usb_pickit_config_from_memory (&s->config, dev->cfg);
 
-      send_usb (d, cmd);
+      if (s->config.save_osccal || (what & PICKIT_READ_PROGRAM))
+	osccal = &s->config.osccal;
     }
 
-  /* if max_ee is not a multiple of four, write the last bytes */
-  int r = p->max_ee % 4;
-  if (r != 0)
+  if ((what & PICKIT_READ_EEPROM) && s->program.ee_len > 0)
+    usb_pickit_read_eeprom_entry (d, &s->program, ee);
+
+  if ((what & PICKIT_READ_PROGRAM) || osccal)
+    usb_pickit_read_program_entry (d, &s->program,
+				   (what & PICKIT_READ_PROGRAM) ? prog : &none,
+				   osccal);
+
+  cmd_send (d, "V1");
+}
+
+/*
+ * write this program's data to device's EEPROM.
+ */
+void
+usb_pickit_write_eeprom (usb_pickit *d, pic14_program *p)
+{
+  unsigned int i, run = 0, skipped = 0;
+
+  /* enter programming mode */
+  cmd_send (d, "P");
+
+  /* write out the EEPROM data */
+  if (!d->quiet)
+    printf ("writing %d eeprom words\n", p->max_ee);
+
+  /* write data bytes to EEPROM, four of them fit in a packet.  the
+     data memory was erased, so runs of blank bytes (0xff) are
+     jumped over with 'I' instead of spending 8 ms on each */
+  for (i = 0; i < p->max_ee; ++i)
     {
-      i = p->max_ee - r;
+      if ((p->ee[i] & 0xff) == 0xff)
+	{
+	  run++;
+	  continue;
+	}
 
-      /* encapsulate last bytes into a single packet */
-      sprintf (cmd, "ZZZZZZZZ");
-      for (j = 0; j < r; ++j, ++i)
+      if (run)
 	{
-	  cmd[j * 2 + 0] = 'D';
-	  cmd[j * 2 + 1] = (char)(p->ee[i]);
+	  cmd_word (d, 'I', run);
+	  skipped += run;
+	  run = 0;
 	}
 
-      /* burn last data bytes */
-      send_usb (d, cmd);
+      cmd_data (d, p->ee[i]);
     }
 
+  skipped += run;
+  if (skipped && !d->quiet)
+    printf ("skipped %d blank eeprom words\n", skipped);
+
   /* exit programming mode */
-  send_usb (d, "pZZZZZZZ");
+  cmd_send (d, "p");
 }
 
 /*
@@ -694,15 +1140,20 @@ usb_pickit_write_eeprom (usb_pickit *d, pic14_program *p)
 void
 usb_pickit_write_program (usb_pickit *d, pic14_program *p)
 {
+  unsigned int skipped;
+
   /* enter programming mode */
-  send_usb (d, "PZZZZZZZ");
+  cmd_send (d, "P");
 
   /* write out the program data */
-  printf ("writing %d program words\n", p->max_prog);
-  send_usb_words (d, p->max_prog, p->inst);
+  if (!d->quiet)
+    printf ("writing %d program words\n", p->max_prog);
+  skipped = send_usb_words (d, p->max_prog, p->inst);
+  if (skipped && !d->quiet)
+    printf ("skipped %d blank program words\n", skipped);
 
   /* exit programming mode; power on */
-  send_usb (d, "pV1ZZZZZ");
+  cmd_send (d, "pV1");
 }
 
 /*
@@ -713,38 +1164,35 @@ void
 usb_pickit_write_config (usb_pickit *d, pic14_config *c)
 {
   /* write OSCCAL to 0x03ff */
-  send_usb (d, "V0V1PI\xff\x03");
+  cmd_send (d, "V0V1P");
+  cmd_word (d, 'I', 0x03ff);
   if (c->save_osccal)
-    send_usb_word (d, c->osccal);
+    {
+      cmd_hole (d, PLAN_HOLE_OSCCAL);
+      cmd_word (d, 'W', c->osccal);
+    }
 
   /* write configuration ID's to 0x2000 */
-  send_usb (d, "pV0V1PCZ");
+  cmd_send (d, "pV0V1PC");
   send_usb_words (d, PIC14_ID_LEN, c->id);
 
   /* write configuration word to 0x2007 */
-  send_usb (d, "pPCI\x07\x00ZZ");
-  send_usb_word (d, c->config);
-  send_usb (d, "pV1ZZZZZ");
+  cmd_send (d, "pPC");
+  cmd_word (d, 'I', 0x0007);
+  cmd_hole (d, PLAN_HOLE_CONFIG);
+  cmd_word (d, 'W', c->config);
+  cmd_send (d, "pV1");
 }
 
 /*
- * write this state to the device.  If keepOld (RECOMMENDED),
- * will preserve old osccal and BG bits.
+ * erase the device and write this state.  OSCCAL and BG bits are
+ * merged from oldconfig, or written from the state if it is NULL.
  */
-void
-usb_pickit_write (usb_pickit *d, pic14_state *s, bool keep_old)
+static void
+usb_pickit_write_state (usb_pickit *d, pic14_state *s,
+			pic14_config *oldconfig)
 {
-  /* save old config bits */
   int keep_eeprom;
-  pic14_config oldconfig;
-
-  /* calculate checksum by software */
-  usb_pickit_calc_checksum (s);
-  printf ("calculated checksum from .hex file: %#04x\n",
-	  s->program.instchecksum);
-
-  if (keep_old)
-    usb_pickit_read_config (d, &oldconfig);
 
   if (s->program.max_ee == 0)
     keep_eeprom = 1;
@@ -777,34 +1225,138 @@ usb_pickit_write (usb_pickit *d, pic14_state *s, bool keep_old)
   printf ("calculated checksum from .hex file: %#04x\n",
 	  s->program.instchecksum);
 
-  /* calculate checksum by PICKit */
-  usb_pickit_read_checksum (d, s);
-  pic14_word pgmchecksum = ((s->config.config & s->config.configmask)
-		 + s->config.pgmchecksum) & 0xffff;
-  printf ("checksum from PICKit: %#20x\n", pgmchecksum);
+  /* calculate checksum by PICKit */
+  usb_pickit_read_checksum (d, s);
+  pic14_word pgmchecksum = ((s->config.config & s->config.configmask)
+		 + s->config.pgmchecksum) & 0xffff;
+  printf ("checksum from PICKit: %#20x\n", pgmchecksum);
+
+  if (s->program.instchecksum == pgmchecksum)
+    printf ("checksums are equal: device programming successful.\n");
+  else
+    printf ("checksum verify failed: error in programming!\n");
+#endif
+
+  /*
+   * JEB - moved config word program to after program memory because
+   * othererwise, would set the code protect bits before the write of
+   * program and data memory, which would not allow the write of
+   * program or data memory.  works fine with 2.0.2 firmware.
+   */
+  if (oldconfig)
+    {
+      /* normal case: merge new and old configs */
+      usb_pickit_merge_config (d, oldconfig, &s->config);
+    }
+  else
+    {
+      /* DANGEROUS: blast in new config */
+      usb_pickit_write_config (d, &s->config);
+    }
+}
+
+/*
+ * write this state to the device.  If keepOld (RECOMMENDED),
+ * will preserve old osccal and BG bits.
+ */
+void
+usb_pickit_write (usb_pickit *d, pic14_state *s, bool keep_old)
+{
+  /* save old config bits */
+  pic14_config oldconfig;
+
+  /* calculate checksum by software, unless the cache did */
+  if (!s->program.summed)
+    usb_pickit_calc_checksum (s);
+  if (!d->quiet)
+    printf ("calculated checksum from .hex file: %#04x\n",
+	    s->program.instchecksum);
+
+  if (keep_old)
+    {
+      usb_pickit_read_config (d, &oldconfig);
+      usb_pickit_write_state (d, s, &oldconfig);
+    }
+  else
+    usb_pickit_write_state (d, s, NULL);
+}
+
+/*
+ * return true if the device already holds this state, so that
+ * writing it again can be skipped.
+ *
+ * the program and EEPROM sums computed by the firmware ('S') and the
+ * CONFIG word are compared first; any difference there means the
+ * device must be written.  as equal sums do not prove equal
+ * contents, a match is confirmed by reading the device back.
+ * EEPROM is only compared if the state has EEPROM data, as
+ * usb_pickit_write keeps the device's EEPROM otherwise.
+ */
+int
+usb_pickit_is_programmed (usb_pickit *d, pic14_state *s)
+{
+  pic14_arena arena;
+  pic14_state dev, sums;
+  pic14_config config;
+  pic14_word instsum;
+  int i, same;
+
+  /* the state's sums, as the cache stored them or computed here;
+     the firmware's program sum leaves out the CONFIG word */
+  sums = *s;
+  if (!sums.program.summed)
+    pic14_calc_checksum (&sums);
+
+  instsum = (pic14_word)((sums.program.instchecksum
+			  - (s->config.config & s->config.configmask))
+			 & 0xffff);
+
+  /* let the PICkit compute the sums of program and EEPROM memory,
+     into the copy: the state is left alone */
+  usb_pickit_read_checksum (d, &sums);
 
-  if (s->program.instchecksum == pgmchecksum)
-    printf ("checksums are equal: device programming successful.\n");
-  else
-    printf ("checksum verify failed: error in programming!\n");
-#endif
+  if (sums.config.pgmchecksum != instsum)
+    return 0;
 
-  /*
-   * JEB - moved config word program to after program memory because
-   * othererwise, would set the code protect bits before the write of
-   * program and data memory, which would not allow the write of
-   * program or data memory.  works fine with 2.0.2 firmware.
-   */
-  if (keep_old)
+  if (s->program.max_ee > 0
+      && sums.config.eechecksum != sums.program.eechecksum)
+    return 0;
+
+  usb_pickit_read_config (d, &config);
+
+  if ((config.config & s->config.configmask) !=
+      (s->config.config & s->config.configmask))
+    return 0;
+
+  for (i = 0; i < PIC14_ID_LEN; ++i)
     {
-      /* normal case: merge new and old configs */
-      usb_pickit_merge_config (d, &oldconfig, &s->config);
+      if ((config.id[i] & 0x7f) != (s->config.id[i] & 0x7f))
+	return 0;
     }
-  else
+
+  /* sums match, compare the actual contents, read into an image
+     of the same size that only lives here */
+  pic14_arena_init (&arena);
+  pic14_state_init (&dev);
+  dev.arena = &arena;
+
+  if (!pic14_state_size (&dev, s->program.inst_len, s->program.ee_len))
+    return 0;
+
+  usb_pickit_read_program (d, &dev.program);
+  same = !memcmp (dev.program.inst, s->program.inst,
+		  s->program.inst_len * sizeof (pic14_word));
+
+  if (same && s->program.max_ee > 0)
     {
-      /* DANGEROUS: blast in new config */
-      usb_pickit_write_config (d, &s->config);
+      usb_pickit_read_eeprom (d, &dev.program);
+      same = !memcmp (dev.program.ee, s->program.ee,
+		      s->program.ee_len * sizeof (pic14_word));
     }
+
+  pic14_arena_free (&arena);
+
+  return same;
 }
 
 /*
@@ -829,17 +1381,20 @@ usb_pickit_erase (usb_pickit *d, pic14_state *s)
   if (s->config.save_osccal)
     {
       /* write OSCCAL to 0x03ff */
-      send_usb (d, "V0V1PI\xff\x03");
-      send_usb_word (d, oldconfig.osccal);
+      cmd_send (d, "V0V1P");
+      cmd_word (d, 'I', 0x03ff);
+      cmd_word (d, 'W', oldconfig.osccal);
 
       /* restore BG bits and then write configuration word to 0x2007 */
       bgbits = (0x3000 & oldconfig.config) | s->config.configmask;
-      send_usb (d, "pPCI\x07\x00ZZ");
-      send_usb_word (d, bgbits);
-      send_usb (d, "pV1ZZZZZ");
+      cmd_send (d, "pPC");
+      cmd_word (d, 'I', 0x0007);
+      cmd_word (d, 'W', bgbits);
+      cmd_send (d, "pV1");
     }
 
-  printf ("device erased.\n");
+  if (!d->quiet)
+    printf ("device erased.\n");
 }
 
 /*
@@ -850,9 +1405,9 @@ usb_pickit_reset (usb_pickit *d, bool keep_eeprom)
 {
   /* blank out the device completely */
   if (keep_eeprom)
-    send_usb (d, "PCEpZZZZ");
+    cmd_send (d, "PCEp");
   else
-    send_usb (d, "PCEepZZZ");
+    cmd_send (d, "PCEep");
 }
 
 /*
@@ -876,6 +1431,263 @@ usb_pickit_merge_config (usb_pickit *d, pic14_config *oldconfig,
   usb_pickit_write_config (d, &merged);
 }
 
+/*
+ * a plan file's header.  it is followed by the holes, then by the
+ * packets.  like cache images, plan files use the host's byte order.
+ */
+typedef struct
+{
+  char magic[4];              /* "PK1P" */
+  unsigned int version;       /* PLAN_VERSION */
+  pic14_word device_id;
+  pic14_word instchecksum;    /* of the .hex file */
+  unsigned int packets;
+  unsigned int holes;
+
+} usb_pickit_plan_header;
+
+/*
+ * record the packets usb_pickit_write sends for this state, keeping
+ * the old OSCCAL and BG bits, and save them to a plan file.
+ */
+int
+usb_pickit_compile (usb_pickit *d, pic14_device *dev, FILE *fp)
+{
+  pic14_state *s = &dev->state;
+  usb_pickit_plan_header h;
+  usb_pickit_plan plan;
+  pic14_config oldconfig;
+  int ok;
+
+  if (!s->program.summed)
+    usb_pickit_calc_checksum (s);
+  printf ("calculated checksum from .hex file: %#04x\n",
+	  s->program.instchecksum);
+
+  /* what is still queued goes to the device, not into the plan */
+  flush_usb (d);
+
+  /* the old OSCCAL and CONFIG words are holes, merged as zeros
+     here and filled in at replay */
+  memset (&plan, 0, sizeof (plan));
+  memset (&oldconfig, 0, sizeof (oldconfig));
+
+  d->plan = &plan;
+  usb_pickit_write_state (d, s, &oldconfig);
+  cmd_end (d);
+  d->plan = NULL;
+
+  if (plan.failed)
+    {
+      fprintf (stderr, "Error: could not record the plan\n");
+      free (plan.packets);
+      return 0;
+    }
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, "PK1P", 4);
+  h.version = PLAN_VERSION;
+  h.device_id = dev->dinfo->device_id;
+  h.instchecksum = s->program.instchecksum;
+  h.packets = plan.count;
+  h.holes = plan.holes;
+
+  ok = fwrite (&h, sizeof (h), 1, fp) == 1
+    && fwrite (plan.hole, sizeof (usb_pickit_hole), plan.holes, fp)
+       == plan.holes
+    && fwrite (plan.packets, REQ_LEN, plan.count, fp) == plan.count;
+
+  free (plan.packets);
+
+  if (!ok)
+    {
+      fprintf (stderr, "Error: could not write the plan\n");
+      return 0;
+    }
+
+  printf ("plan holds %u packets, %u words filled in at replay\n",
+	  h.packets, h.holes);
+
+  return 1;
+}
+
+/*
+ * read a plan file.  returns 0 on errors.
+ */
+static int
+usb_pickit_read_plan (FILE *fp, usb_pickit_plan_header *h,
+		      usb_pickit_plan *plan)
+{
+  unsigned int i;
+
+  memset (plan, 0, sizeof (*plan));
+
+  if (fread (h, sizeof (*h), 1, fp) != 1
+      || memcmp (h->magic, "PK1P", 4) != 0
+      || h->version != PLAN_VERSION
+      || h->holes > PLAN_MAX_HOLES)
+    {
+      fprintf (stderr, "Error: not a plan file\n");
+      return 0;
+    }
+
+  plan->packets = (byte *)malloc (h->packets * REQ_LEN + 1);
+  if (!plan->packets)
+    {
+      fprintf (stderr, "Error: out of memory\n");
+      return 0;
+    }
+
+  plan->count = h->packets;
+  plan->size = h->packets;
+  plan->holes = h->holes;
+
+  if (fread (plan->hole, sizeof (usb_pickit_hole), plan->holes, fp)
+      != plan->holes
+      || fread (plan->packets, REQ_LEN, plan->count, fp) != plan->count)
+    {
+      fprintf (stderr, "Error: truncated plan file\n");
+      free (plan->packets);
+      return 0;
+    }
+
+  for (i = 0; i < plan->holes; ++i)
+    {
+      if (plan->hole[i].packet >= plan->count
+	  || (plan->hole[i].kind != PLAN_HOLE_OSCCAL
+	      && plan->hole[i].kind != PLAN_HOLE_CONFIG)
+	  || plan->hole[i].offset < 1 || plan->hole[i].offset > REQ_LEN - 2
+	  || plan->packets[plan->hole[i].packet * REQ_LEN
+			   + plan->hole[i].offset - 1] != 'W')
+	{
+	  fprintf (stderr, "Error: bad hole in plan file\n");
+	  free (plan->packets);
+	  return 0;
+	}
+    }
+
+  return 1;
+}
+
+/*
+ * send a plan's packets to the device, filling its holes with the
+ * device's old OSCCAL and BG bits.
+ */
+int
+usb_pickit_replay (usb_pickit *d, pic14_device *dev, FILE *fp)
+{
+  usb_pickit_plan_header h;
+  usb_pickit_plan plan;
+  pic14_config oldconfig;
+  unsigned int i;
+
+  if (!usb_pickit_read_plan (fp, &h, &plan))
+    return 0;
+
+  if (h.device_id != dev->dinfo->device_id)
+    {
+      const pic14_device_info *info = pic14_get_device (h.device_id);
+
+      fprintf (stderr, "Error: plan is for a %s, not for a %s\n",
+	       info ? info->device_name : "unknown device",
+	       dev->dinfo->device_name);
+      free (plan.packets);
+      return 0;
+    }
+
+  usb_pickit_read_config (d, &oldconfig);
+
+  for (i = 0; i < plan.holes; ++i)
+    {
+      byte *w = plan.packets + plan.hole[i].packet * REQ_LEN
+	+ plan.hole[i].offset;
+      pic14_word word = w[0] | (w[1] << 8);
+
+      if (plan.hole[i].kind == PLAN_HOLE_OSCCAL)
+	word = oldconfig.osccal;
+      else
+	word = (oldconfig.config & BG_MASK) + (word & ~BG_MASK);
+
+      w[0] = (byte)(word & 0xff);
+      w[1] = (byte)((word >> 8) & 0xff);
+    }
+
+  printf ("replaying %u packets, checksum %#04x\n", plan.count,
+	  h.instchecksum);
+
+  /* the plan starts with a fresh packet */
+  cmd_end (d);
+  for (i = 0; i < plan.count; ++i)
+    send_usb (d, plan.packets + i * REQ_LEN);
+
+  flush_usb (d);
+  free (plan.packets);
+
+  return 1;
+}
+
+/*
+ * print a plan's packets, for auditing.
+ */
+int
+usb_pickit_print_plan (FILE *fp)
+{
+  const pic14_device_info *info;
+  usb_pickit_plan_header h;
+  usb_pickit_plan plan;
+  unsigned int i, j, k;
+
+  if (!usb_pickit_read_plan (fp, &h, &plan))
+    return 0;
+
+  info = pic14_get_device (h.device_id);
+  printf ("plan for %s (device ID %#06x), checksum %#04x: "
+	  "%u packets\n", info ? info->device_name : "unknown device",
+	  h.device_id, h.instchecksum, h.packets);
+
+  for (i = 0; i < plan.count; ++i)
+    {
+      const byte *p = plan.packets + i * REQ_LEN;
+      char text[REQ_LEN + 1];
+
+      printf ("%06x:", i);
+
+      for (j = 0; j < REQ_LEN; ++j)
+	{
+	  bool hole = 0;
+
+	  for (k = 0; k < plan.holes; ++k)
+	    if (plan.hole[k].packet == i
+		&& (j == plan.hole[k].offset || j == plan.hole[k].offset + 1))
+	      hole = 1;
+
+	  if (hole)
+	    {
+	      printf (" ??");
+	      text[j] = '?';
+	    }
+	  else
+	    {
+	      printf (" %02x", p[j]);
+	      text[j] = (p[j] >= 0x20 && p[j] < 0x7f) ? p[j] : '.';
+	    }
+	}
+
+      text[REQ_LEN] = '\0';
+      printf ("  %s\n", text);
+    }
+
+  for (k = 0; k < plan.holes; ++k)
+    printf ("packet %06x, byte %u: %s\n", plan.hole[k].packet,
+	    plan.hole[k].offset,
+	    plan.hole[k].kind == PLAN_HOLE_OSCCAL ?
+	    "OSCCAL word read from the device" :
+	    "CONFIG word, bandgap bits read from the device");
+
+  free (plan.packets);
+  return 1;
+}
+
 /*
  * set Bandgap bits. (JEB)
  * for 629, 675, 630 and 676 only.
@@ -890,8 +1702,8 @@ usb_pickit_set_bandgap (usb_pickit *d, pic14_state *s, int bgarg)
 
   if (bg > 3)
     {
-      fprintf (stderr, "Error: bandgap must be between 0 and 3");
-      exit (-1);
+      fprintf (stderr, "Error: bandgap must be between 0 and 3\n");
+      return;
     }
 
   /* 629, 675, 630 or 676, only 629, 675, 630 and 676 devices
@@ -905,15 +1717,17 @@ usb_pickit_set_bandgap (usb_pickit *d, pic14_state *s, int bgarg)
       usb_pickit_reset (d, 0);
 
       /* write OSCCAL to 0x03ff */
-      send_usb (d, "V0V1PI\xff\x03");
-      send_usb_word (d, oldconfig.osccal);
+      cmd_send (d, "V0V1P");
+      cmd_word (d, 'I', 0x03ff);
+      cmd_word (d, 'W', oldconfig.osccal);
 
       /* insert BG bits and then write CONFIG word to 0x2007 */
       configword = (bg << 12) | s->config.configmask;
 
-      send_usb (d, "pPCI\x07\x00ZZ");
-      send_usb_word (d, configword);
-      send_usb (d, "pV1ZZZZZ");
+      cmd_send (d, "pPC");
+      cmd_word (d, 'I', 0x0007);
+      cmd_word (d, 'W', configword);
+      cmd_send (d, "pV1");
 
       printf ("device erased.\n");
       printf ("OSCCAL 0x%04x reprogrammed.\n", oldconfig.osccal);
@@ -954,9 +1768,10 @@ usb_pickit_osccal_regen (usb_pickit *d, pic14_state *s)
   if (s->config.save_osccal)
     {
       /* read CONFIG word from 0x2007, and power off device */
-      send_usb (d, "pPCI\x07\x00ZZ");
+      cmd_send (d, "pPC");
+      cmd_word (d, 'I', 0x0007);
       recv_usb_words (d, 1, &configword);
-      send_usb (d, "pV1ZZZZZ");
+      cmd_send (d, "pV1");
 
       /* start PICkit 2.5 kHz Osc and then power up device.
 	 delay and then power down device */
@@ -966,8 +1781,11 @@ usb_pickit_osccal_regen (usb_pickit *d, pic14_state *s)
 
       /* get the calibrated value stored in the last location of
 	 data memory */
-      send_usb (d, "PI\x78\x00rpZZ");
+      cmd_send (d, "P");
+      cmd_word (d, 'I', 0x0078);
+      cmd_read (d, 'r', 1);
       recv_usb (d, 8, eedata);
+      cmd_send (d, "p");
 
       /* wipe device */
       usb_pickit_reset (d, 0);
@@ -976,16 +1794,17 @@ usb_pickit_osccal_regen (usb_pickit *d, pic14_state *s)
       osccal = eedata[7];
       osccal = osccal | 0x3400; /* or with 0x34 to create retlw value */
 
-      send_usb (d, "pV1ZZZZZ");
-      send_usb (d, "PI\xff\x03ZZZZ");
-      send_usb_word (d, osccal);
+      cmd_send (d, "pV1P");
+      cmd_word (d, 'I', 0x03ff);
+      cmd_word (d, 'W', osccal);
 
       /* write configuration word to 0x2007 */
       configword = (0x3000 & configword) | s->config.configmask;
 
-      send_usb (d, "pPCI\x07\x00ZZ");
-      send_usb_word (d, configword);
-      send_usb (d, "pV1ZZZZZ");
+      cmd_send (d, "pPC");
+      cmd_word (d, 'I', 0x0007);
+      cmd_word (d, 'W', configword);
+      cmd_send (d, "pV1");
 
       printf ("device erased.\n");
       printf ("OSCCAL 0x%04x regenerated and programmed.\n", osccal);
@@ -1003,29 +1822,32 @@ usb_pickit_osccal_regen (usb_pickit *d, pic14_state *s)
  * print program memory map of the device.
  */
 static void
-usb_pickit_program_map (usb_pickit *d, pic14_state *s)
+usb_pickit_program_map (usb_pickit *d, pic14_state *s,
+			const pic14_range *r)
 {
   int i, j;
-  pic14_addr memlength;
-  memlength = s->program.inst_len;
+  pic14_addr start, memlength;
+  start = r ? r->addr : 0;
+  memlength = r ? r->addr + r->len : s->program.inst_len;
 
   printf ("program memory:\n");
 
   /* include last byte (OscCal) for 629, 675, 630 and 676 devices */
-  if(s->config.save_osccal)
+  if(s->config.save_osccal && memlength == s->program.inst_len)
     {
       memlength = memlength + 1;
       s->program.inst[s->program.inst_len] = s->config.osccal;
     }
 
   /* print program memory */
-  for (i = 0; i < memlength; i += 8)
+  for (i = start; i < memlength; i += 8)
     {
       printf ("Addr 0x%04x:[", i);
-      for (j = 0; j < 8; ++j)
+      for (j = 0; j < 8 && (r == NULL || i + j < memlength); ++j)
 	{
 	  printf ("0x%04x", s->program.inst[i + j]);
-	  printf ("%s", (j < 7) ? " " : "]\n");
+	  printf ("%s", (j < 7 && (r == NULL || i + j + 1 < memlength))
+		  ? " " : "]\n");
 	}
     }
 
@@ -1036,19 +1858,23 @@ usb_pickit_program_map (usb_pickit *d, pic14_state *s)
  * print data memory map of the device.
  */
 static void
-usb_pickit_eeprom_map (usb_pickit *d, pic14_state *s)
+usb_pickit_eeprom_map (usb_pickit *d, pic14_state *s,
+		       const pic14_range *r)
 {
   int i, j;
+  pic14_addr start, memlength;
+  start = r ? r->addr : 0;
+  memlength = r ? r->addr + r->len : s->program.ee_len;
 
   printf ("EEPROM data memory:\n");
 
-  for (i = 0; i < s->program.ee_len; i += 8)
+  for (i = start; i < memlength; i += 8)
     {
       printf ("Addr 0x%02x:[", i);
-      for (j = 0; j < 8; ++j)
+      for (j = 0; j < 8 && i + j < memlength; ++j)
 	{
 	  printf ("0x%02x", s->program.ee[i + j]);
-	  printf ("%s", (j < 7) ? " " : "]\n");
+	  printf ("%s", (j < 7 && i + j + 1 < memlength) ? " " : "]\n");
 	}
     }
 
@@ -1067,8 +1893,18 @@ usb_pickit_eeprom_map (usb_pickit *d, pic14_state *s)
 void
 usb_pickit_memory_map (usb_pickit *d, pic14_state *s)
 {
-  usb_pickit_program_map (d, s);
-  usb_pickit_eeprom_map (d, s);
+  usb_pickit_memory_map_range (d, s, NULL, NULL);
+}
+
+/*
+ * print windows of the program and eeprom data memory map.
+ */
+void
+usb_pickit_memory_map_range (usb_pickit *d, pic14_state *s,
+			     const pic14_range *prog, const pic14_range *ee)
+{
+  usb_pickit_program_map (d, s, prog);
+  usb_pickit_eeprom_map (d, s, ee);
 }
 
 /*
@@ -1082,24 +1918,20 @@ usb_pickit_memory_map (usb_pickit *d, pic14_state *s)
  * above 7.  this is specified by all Microship programmers
  */
 void
-usb_pickit_print_config (usb_pickit *d, pic14_state *s)
+usb_pickit_print_config (usb_pickit *d, pic14_device *dev)
 {
-  pic14_word id[8], osccal[1], checksum[2];
-  char cmd[REQ_LEN + 1];
+  pic14_state *s = &dev->state;
+  pic14_word *id = dev->cfg, sum;
+  byte checksum[REQ_LEN];
   int i;
 
-  /* read OSCCAL from 0x3ff */
-  if (s->config.save_osccal)
-    {
-      send_usb (d, "V0V1PI\xff\x03");
-      recv_usb_words (d, 1, osccal);
-      printf("               OSCCAL data: [0x03ff]=0x%04x\n", osccal[0]);
-    }
+  /* OSCCAL and the 8 configuration words at 0x2000 were read by
+     the session */
+  usb_pickit_read_device (d, dev, PICKIT_READ_CONFIG, NULL, NULL);
 
-  /* now reset and read 8 configuration bytes at 0x2000 */
-  send_usb (d, "pV0V1PCZ");
-  recv_usb_words (d, 8, id);
-  send_usb (d, "pV1ZZZZZ");
+  if (s->config.save_osccal)
+    printf("               OSCCAL data: [0x03ff]=0x%04x\n",
+	   s->config.osccal);
 
   for (i = 0; i < 4; ++i)
     printf("          configuration ID: [0x%04x]=0x%02x\n",
@@ -1117,21 +1949,16 @@ usb_pickit_print_config (usb_pickit *d, pic14_state *s)
 	    (id[7] & 0x3000) >> 12);
 
   /* read programmer checksum values  */
-  sprintf (cmd, "S____V1Z");
-
-  cmd[1] = (char)(s->program.inst_len & 0xff);
-  cmd[2] = (char)(s->program.inst_len >> 8);
-  cmd[3] = (char)(s->program.ee_len & 0xff);
-  cmd[4] = (char)(s->program.ee_len >> 8);
+  cmd_checksum (d, s->program.inst_len, s->program.ee_len);
+  recv_usb (d, REQ_LEN, checksum);
+  cmd_send (d, "pV1");
 
-  send_usb (d, cmd);
-  recv_usb_words (d, 2, checksum);
-  send_usb (d, "pV1ZZZZZ");
+  sum = checksum[0] + (checksum[1] << 8);
 
-  printf ("PICkit Programmer checksum: 0x%04x\n", checksum[0]);
-  printf ("PICkit Prg+Config checksum: 0x%04x\n", (checksum[0]
+  printf ("PICkit Programmer checksum: 0x%04x\n", sum);
+  printf ("PICkit Prg+Config checksum: 0x%04x\n", (sum
 		     + (id[7] & s->config.configmask)) & 0xffff);
-  printf ("PICkit Prgrmr chksm EEData: 0x%02x\n", checksum[1] & 0x00ff);
+  printf ("PICkit Prgrmr chksm EEData: 0x%02x\n", checksum[2]);
 }
 
 /*
@@ -1254,6 +2081,188 @@ usb_pickit_verify (pic14_state *file, pic14_state *dev)
   return 0;
 }
 
+/*
+ * read len words of memory region what, starting at the current pc
+ * (address addr), and compare each batch with expect as soon as it
+ * arrives.  without expect, the words are checked to be blank (all
+ * bits of mask set).  with map, only the addresses set in that
+ * coverage map are compared.  the EEPROM is read when ee is set.
+ * every mismatch is reported with its address and counted in errors.
+ * returns false once max_errors mismatches have been seen
+ * (max_errors <= 0: no limit), so that the caller stops reading.
+ */
+static int
+usb_pickit_verify_stream (usb_pickit *d, bool ee, const char *what,
+			  pic14_addr addr, unsigned int len,
+			  pic14_word *expect, const byte *map,
+			  pic14_word mask, int *errors, int max_errors)
+{
+  while (len > 0)
+    {
+      pic14_word buffer[REQ_LEN * REQ_LEN];
+      unsigned int i, c = ee ? REQ_LEN * REQ_LEN : 4 * REQ_LEN;
+
+      if (c > len)
+	c = len;
+
+      /* one round trip's worth of data */
+      if (ee)
+	recv_usb_eeprom (d, c, buffer);
+      else
+	recv_usb_words (d, c, buffer);
+
+      for (i = 0; i < c; ++i)
+	{
+	  if (map && !PIC14_MAP_TEST (map, addr + i))
+	    continue;
+
+	  if ((buffer[i] & mask) == (expect ? expect[i] & mask : mask))
+	    continue;
+
+	  if (expect)
+	    fprintf (stderr, "Error: %s mismatch at 0x%04x: "
+		     ".hex file 0x%0*x, device 0x%0*x\n", what, addr + i,
+		     ee ? 2 : 4, expect[i] & mask,
+		     ee ? 2 : 4, buffer[i] & mask);
+	  else
+	    fprintf (stderr, "Error: %s is not blank at 0x%04x: 0x%0*x\n",
+		     what, addr + i, ee ? 2 : 4, buffer[i] & mask);
+
+	  if (++*errors == max_errors)
+	    return 0;
+	}
+
+      addr += c;
+      if (expect)
+	expect += c;
+      len -= c;
+    }
+
+  return 1;
+}
+
+/*
+ * verify one memory region against expect, which holds the whole
+ * region.  only the window r is read (NULL: len words from 0).  with
+ * map, only the runs of addresses the coverage map defines are read,
+ * moving the pc over the holes with 'I'.  each 'R' reads 4 words and
+ * each 'r' 8 bytes, so holes shorter than that are read through.
+ */
+static int
+usb_pickit_verify_region (usb_pickit *d, bool ee, const char *what,
+			  pic14_word *expect, const byte *map,
+			  const pic14_range *r, pic14_addr len,
+			  pic14_word mask, int *errors, int max_errors)
+{
+  pic14_addr addr = r ? r->addr : 0, end = r ? r->addr + r->len : len;
+  pic14_addr pc, count, step = ee ? REQ_LEN : 4;
+
+  usb_pickit_seek (d, addr);
+
+  if (!map)
+    return usb_pickit_verify_stream (d, ee, what, addr, end - addr,
+				     expect + addr, NULL, mask,
+				     errors, max_errors);
+
+  pc = addr;
+  while (pic14_map_extent (map, end, step - 1, &addr, &count))
+    {
+      if (addr > pc)
+	cmd_word (d, 'I', addr - pc);
+
+      if (!usb_pickit_verify_stream (d, ee, what, addr, count,
+				     expect + addr, map, mask,
+				     errors, max_errors))
+	return 0;
+
+      /* the pc ends up after the last word of the last read */
+      pc = addr + (count + step - 1) / step * step;
+      addr += count;
+    }
+
+  return 1;
+}
+
+/*
+ * verify the device against a .hex file while reading it: program
+ * memory first, then the configuration IDs and CONFIG word, then
+ * EEPROM data memory.  only the windows prog and ee of program and
+ * EEPROM memory are read (NULL: whole memory), and with defined only
+ * the addresses and configuration words the .hex file sets.  reading
+ * stops after max_errors mismatches (max_errors <= 0: compare
+ * everything).
+ * returns true if the device matches.
+ */
+int
+usb_pickit_verify_device (usb_pickit *d, pic14_state *file,
+			  const pic14_range *prog, const pic14_range *ee,
+			  bool defined, int max_errors)
+{
+  pic14_word id[8];
+  int i, errors = 0;
+
+  /* program memory */
+  if (!usb_pickit_verify_region (d, 0, "program memory",
+				 file->program.inst,
+				 defined ? file->program.inst_map : NULL,
+				 prog, file->program.inst_len,
+				 0x3fff, &errors, max_errors))
+    goto done;
+
+  /* configuration IDs (low 7 bits) and CONFIG word */
+  cmd_send (d, "pV0V1PC");
+  recv_usb_words (d, 8, id);
+
+  for (i = 0; i < PIC14_ID_LEN; ++i)
+    {
+      if (defined && !(file->config.defined & (1 << i)))
+	continue;
+
+      if ((id[i] & 0x7f) == (file->config.id[i] & 0x7f))
+	continue;
+
+      fprintf (stderr, "Error: config ID mismatch at 0x%04x: "
+	       ".hex file 0x%02x, device 0x%02x\n", 0x2000 + i,
+	       file->config.id[i] & 0x7f, id[i] & 0x7f);
+
+      if (++errors == max_errors)
+	goto done;
+    }
+
+  if ((!defined || (file->config.defined & PIC14_DEFINED_CONFIG)) &&
+      (id[7] & file->config.configmask) !=
+      (file->config.config & file->config.configmask))
+    {
+      fprintf (stderr, "Error: CONFIG word mismatch: "
+	       ".hex file 0x%04x, device 0x%04x\n",
+	       file->config.config & file->config.configmask,
+	       id[7] & file->config.configmask);
+
+      if (++errors == max_errors)
+	goto done;
+    }
+
+  /* EEPROM data memory */
+  cmd_send (d, "p");
+  usb_pickit_verify_region (d, 1, "EE Data memory", file->program.ee,
+			    defined ? file->program.ee_map : NULL,
+			    ee, file->program.ee_len,
+			    0xff, &errors, max_errors);
+
+ done:
+  cmd_send (d, "pV1");
+
+  if (errors == 0)
+    {
+      if (!d->quiet)
+	printf ("device successfully verified with .hex file.\n");
+      return 1;
+    }
+
+  fprintf (stderr, "Error: device failed to verify with .hex file!\n");
+  return 0;
+}
+
 /*
  * return true if program memory is blank.
  */
@@ -1348,3 +2357,94 @@ usb_pickit_blank_check (pic14_state *s)
 
   return 0;
 }
+
+/*
+ * stream one memory of the device, checking it is blank.  returns 0
+ * at the first location which is not.
+ */
+static int
+usb_pickit_blank_check_memory (usb_pickit *d, pic14_state *s, bool ee)
+{
+  int errors = 0;
+
+  cmd_send (d, "P");
+
+  if (ee)
+    usb_pickit_verify_stream (d, 1, "EE Data memory", 0x00,
+			      s->program.ee_len, NULL, NULL, 0xff,
+			      &errors, 1);
+  else
+    usb_pickit_verify_stream (d, 0, "program memory", 0x0000,
+			      s->program.inst_len, NULL, NULL, 0x3fff,
+			      &errors, 1);
+
+  cmd_send (d, ee ? "p" : "pV1");
+
+  return !errors;
+}
+
+/*
+ * blank check the device while reading it.
+ *
+ * the firmware checksums ('S') of a blank device are known.  a memory
+ * whose sum is not the blank sum is read first, so that the location
+ * which is not blank is found at once.  equal sums prove nothing, so
+ * every memory is still read before the device is called blank; the
+ * check stops at the first location which is not.  the IDs and CONFIG
+ * word are read in one round trip.
+ */
+int
+usb_pickit_blank_check_device (usb_pickit *d, pic14_state *s)
+{
+  pic14_word id[8], instsum;
+  bool inst_read = 0, ee_read = 0;
+  byte eesum;
+  int i;
+
+  instsum = (pic14_word)(s->program.inst_len * 0x3fff);
+  eesum = (byte)(s->program.ee_len * 0xff);
+
+  usb_pickit_read_checksum (d, s);
+
+  /* a sum which differs points at a memory which is not blank */
+  if (s->config.pgmchecksum != instsum)
+    {
+      if (!usb_pickit_blank_check_memory (d, s, 0))
+	return 0;
+
+      inst_read = 1;
+    }
+
+  if (s->program.ee_len > 0 && s->config.eechecksum != eesum)
+    {
+      if (!usb_pickit_blank_check_memory (d, s, 1))
+	return 0;
+
+      ee_read = 1;
+    }
+
+  /* program memory */
+  if (!inst_read && !usb_pickit_blank_check_memory (d, s, 0))
+    return 0;
+
+  /* configuration IDs and CONFIG word */
+  cmd_send (d, "pV0V1PC");
+  recv_usb_words (d, 8, id);
+  cmd_send (d, "pV1");
+
+  s->config.config = id[7];
+  for (i = 0; i < PIC14_ID_LEN; ++i)
+    s->config.id[i] = id[i];
+
+  if (!usb_pickit_blank_check_config_word (s) ||
+      !usb_pickit_blank_check_config_id (s))
+    return 0;
+
+  /* EEPROM data memory */
+  if (!ee_read && s->program.ee_len > 0
+      && !usb_pickit_blank_check_memory (d, s, 1))
+    return 0;
+
+  printf ("device is blank.\n");
+  return 1;
+}
@@ -21,16 +21,40 @@
 #ifndef __USB_PICKIT_H__
 #define __USB_PICKIT_H__
 
+#include <setjmp.h>
 #include "pic14.h"
+#include "transport.h"
 
-typedef struct usb_dev_handle usb_pickit;
+/* an opened PICkit programmer (opaque) */
+typedef struct usb_pickit usb_pickit;
 
-/* open the pickit as a usb device.  aborts on errors */
+/* open the pickit through the transport named by the PICKIT_TRANSPORT
+   environment variable (default: libusb), recording the session to
+   the file named by PICKIT_RECORD if set.  returns NULL on errors */
 usb_pickit *usb_pickit_open ();
 
+/* number of PICkits attached to the transport */
+int usb_pickit_count ();
+
+/* open the unit-th PICkit (usb_pickit_open opens unit 0).  PICkits
+   opened this way may each be driven from their own thread */
+usb_pickit *usb_pickit_open_unit (int unit);
+
 /* close the usb pickit device */
 void usb_pickit_close (usb_pickit *d);
 
+/* have transfer errors on d jump to env (longjmp (*env, 1)) once they
+   are printed, rather than end the program; NULL to end it again.
+   returns the previous env */
+jmp_buf *usb_pickit_catch (usb_pickit *d, jmp_buf *env);
+
+/* leave out the progress output (words written or skipped, dots) */
+void usb_pickit_quiet (usb_pickit *d, bool quiet);
+
+/* get the traffic since the device was opened.  what is still
+   queued is sent first */
+void usb_pickit_stats (usb_pickit *d, pickit_stats *st);
+
 
 /* turn the device on */
 void usb_pickit_on (usb_pickit *d);
@@ -45,9 +69,48 @@ void usb_pickit_osc_on (usb_pickit *d);
 void usb_pickit_osc_off (usb_pickit *d);
 
 
-/* read device type */
+/* read device type.  this starts a read session: the IDs and
+   CONFIG word are read along with the device ID, into dev->cfg */
 int usb_pickit_get_device (usb_pickit *d, pic14_device *dev);
 
+/* read only the device ID word at 0x2006, with the revision, for
+   polling the socket: a few packets.  without a chip, it is not the
+   ID of a known device */
+pic14_word usb_pickit_read_device_id (usb_pickit *d);
+
+/* a PICkit's socket, watched for chips by usb_pickit_watch.  start
+   with present set if a chip is known to be in */
+typedef struct
+{
+  pic14_word id; /* device ID read last */
+  bool seen;     /* it was a known device's */
+  bool present;  /* a chip is in */
+
+} usb_pickit_socket;
+
+/* what usb_pickit_watch saw */
+#define PICKIT_CHIP_IN   1 /* a chip was put in, its ID is w->id */
+#define PICKIT_CHIP_OUT -1 /* the chip was taken out */
+
+/* read the device ID once, as usb_pickit_read_device_id.  returns
+   PICKIT_CHIP_IN or PICKIT_CHIP_OUT if the socket changed, else 0 */
+int usb_pickit_watch (usb_pickit *d, usb_pickit_socket *w);
+
+/* what usb_pickit_read_device reads */
+#define PICKIT_READ_CONFIG  0x01 /* IDs, CONFIG word and OSCCAL */
+#define PICKIT_READ_EEPROM  0x02
+#define PICKIT_READ_PROGRAM 0x04
+#define PICKIT_READ_ALL     0x07
+
+/* continue the session started by usb_pickit_get_device: read the
+   selected parts of the device, limiting program and EEPROM memory
+   to windows (NULL: all of it), with one programming mode entry for
+   EEPROM and one for program memory and OSCCAL */
+void usb_pickit_read_device (usb_pickit *d, pic14_device *dev,
+			     unsigned int what,
+			     const pic14_range *prog,
+			     const pic14_range *ee);
+
 
 /* JEB - generate checksum from what was read into memory */
 void usb_pickit_calc_checksum (pic14_state *s);
@@ -59,20 +122,36 @@ void usb_pickit_read_checksum (usb_pickit *d, pic14_state *s);
 /* read current EEPROM Data memory from the device. */
 void usb_pickit_read_eeprom (usb_pickit *d, pic14_program *p);
 
+/* read a window of EEPROM Data memory (NULL: all of it) */
+void usb_pickit_read_eeprom_range (usb_pickit *d, pic14_program *p,
+				   const pic14_range *r);
+
 /* read current program memory from the device. */
 void usb_pickit_read_program (usb_pickit *d, pic14_program *p);
 
+/* read a window of program memory (NULL: all of it) */
+void usb_pickit_read_program_range (usb_pickit *d, pic14_program *p,
+				    const pic14_range *r);
+
 /* read current configuration from the device. */
 void usb_pickit_read_config (usb_pickit *d, pic14_config *c);
 
 /* fill out this state with the contents of the device */
 void usb_pickit_read (usb_pickit *d, pic14_state *s);
 
+/* fill out this state with windows of program and EEPROM memory
+   (NULL: all of it) and the configuration */
+void usb_pickit_read_range (usb_pickit *d, pic14_state *s,
+			    const pic14_range *prog,
+			    const pic14_range *ee);
+
 
-/* write program data to device's EEPROM (requires reset first) */
+/* write program data to device's EEPROM (requires reset first).
+   blank bytes are skipped, not written */
 void usb_pickit_write_eeprom (usb_pickit *d, pic14_program *p);
 
-/* write program instructions to the device (requires reset first) */
+/* write program instructions to the device (requires reset first).
+   blank words are skipped, not written */
 void usb_pickit_write_program (usb_pickit *d, pic14_program *p);
 
 /* send off this config.  WARNING: do not reset OSCCAL and BG bits! */
@@ -83,6 +162,25 @@ void usb_pickit_write_config (usb_pickit *d, pic14_config *c);
 void usb_pickit_write (usb_pickit *d, pic14_state *s, bool keepOld);
 
 
+/* record the packets usb_pickit_write (keeping old OSCCAL and BG
+   bits) sends for this device's state into a plan file, without
+   sending them.  the OSCCAL and CONFIG words are left as holes */
+int usb_pickit_compile (usb_pickit *d, pic14_device *dev, FILE *fp);
+
+/* send the packets of a plan file to the device, filling the holes
+   with its old OSCCAL and BG bits.  the plan must be for this
+   device type */
+int usb_pickit_replay (usb_pickit *d, pic14_device *dev, FILE *fp);
+
+/* print the packets of a plan file, holes shown as '??' */
+int usb_pickit_print_plan (FILE *fp);
+
+
+/* return true if the device already holds this state (checksums,
+   CONFIG word, then a full read-back compare) */
+int usb_pickit_is_programmed (usb_pickit *d, pic14_state *s);
+
+
 /* JEB - erase device.  Preserve OSCCAL and BG bits if needed */
 void usb_pickit_erase (usb_pickit *d, pic14_state *s);
 
@@ -109,15 +207,34 @@ void usb_pickit_osccal_regen (usb_pickit *d,pic14_state *s);
 /* print the device memory map, display all program and data memory values */
 void usb_pickit_memory_map (usb_pickit *d, pic14_state *s);
 
+/* print windows of the device memory map (NULL: all of it) */
+void usb_pickit_memory_map_range (usb_pickit *d, pic14_state *s,
+				  const pic14_range *prog,
+				  const pic14_range *ee);
+
 /* print the whole configuration set (osccal, id, and config word).
    JEB - added state as function input to enhance config output */
-void usb_pickit_print_config (usb_pickit *d, pic14_state *s);
+void usb_pickit_print_config (usb_pickit *d, pic14_device *dev);
 
 
 /* JEB - .hex file to device verify operation */
 int usb_pickit_verify (pic14_state *file, pic14_state *dev);
 
+/* verify the device against a .hex file while reading it, stopping
+   after max_errors mismatches (<= 0: no limit).  each mismatch is
+   reported with its address.  prog and ee limit the compare to
+   windows of program and EEPROM memory (NULL: all of it), and
+   defined to the addresses the .hex file actually sets */
+int usb_pickit_verify_device (usb_pickit *d, pic14_state *file,
+			      const pic14_range *prog,
+			      const pic14_range *ee, bool defined,
+			      int max_errors);
+
 /* JEB - device blank check */
 int usb_pickit_blank_check (pic14_state *s);
 
+/* blank check the device while reading it, using the firmware
+   checksums first and stopping at the first non-blank location */
+int usb_pickit_blank_check_device (usb_pickit *d, pic14_state *s);
+
 #endif /* __USB_PICKIT_H__ */